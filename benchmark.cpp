@@ -0,0 +1,305 @@
+// LuaProfilerBenchmark report [node_count] [function_count] [max_threads]
+//   report engine on synthetic trees
+// LuaProfilerBenchmark hook [loop_count]
+//   hook cost of each profiler.start{...} configuration
+// LuaProfilerBenchmark coroutine [switch_count]
+//   coroutine ping-pong through coroutine.resume/wrap and lua_resume from c
+// LuaProfilerBenchmark index [node_count] [function_count]
+//   json dump of a synthetic tree indexed and queried like lua_profiler_index does
+#include <lua.hpp>
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lua_profiler.h"
+#include "lua_profiler_internal.h"
+#include "lua_profiler_index.h"
+
+using namespace std::chrono;
+
+template <typename report_t>
+static double measure_ms(std::string &output, report_t &&report)
+{
+    std::ostringstream os;
+    auto begin = steady_clock::now();
+    report(os);
+    auto duration = duration_cast<microseconds>(steady_clock::now() - begin);
+    output = os.str();
+    return duration.count() / 1000.0;
+}
+
+static int run_report_benchmark(int argc, char const *argv[])
+{
+    size_t node_count = argc > 0 ? std::strtoull(argv[0], nullptr, 10) : 2000000;
+    size_t function_count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : node_count / 4;
+    size_t max_threads = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : std::thread::hardware_concurrency();
+    std::vector<size_t> thread_counts;
+    for (size_t thread_count = 1; thread_count < max_threads; thread_count *= 2)
+    {
+        thread_counts.push_back(thread_count);
+    }
+    thread_counts.push_back(std::max<size_t>(max_threads, 1));
+
+    auto build_begin = steady_clock::now();
+    auto pd = new_synthetic_profile(node_count, std::max<size_t>(function_count, 1), 8);
+    std::cout << fmt::format("tree nodes:{} functions:{} built in {} ms",
+                             get_profile_node_count(*pd),
+                             get_profile_function_count(*pd),
+                             duration_cast<milliseconds>(steady_clock::now() - build_begin).count())
+              << std::endl;
+
+    std::string serial_tree;
+    std::string serial_list;
+    for (auto &&thread_count : thread_counts)
+    {
+        std::string tree;
+        std::string list;
+        auto tree_ms = measure_ms(tree, [&](std::ostream &os) {
+            print_profile_tree(os, *pd, thread_count);
+        });
+        auto list_ms = measure_ms(list, [&](std::ostream &os) {
+            print_profile_list(os, *pd, thread_count);
+        });
+        if (thread_count == 1)
+        {
+            serial_tree = std::move(tree);
+            serial_list = std::move(list);
+        }
+        bool is_same = thread_count == 1 || (tree == serial_tree && list == serial_list);
+        std::cout << fmt::format("threads:{:<4} tree:{:>10.1f} ms  list:{:>10.1f} ms  same_as_serial:{}",
+                                 thread_count, tree_ms, list_ms, is_same)
+                  << std::endl;
+        if (!is_same)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char *hook_workload = R"(
+local loop_count = ...
+local function fib(n)
+    if n < 2 then
+        return n
+    end
+    return fib(n - 1) + fib(n - 2)
+end
+local function concat(n)
+    local t = {}
+    for i = 1, n do
+        t[#t + 1] = tostring(i)
+    end
+    return table.concat(t)
+end
+local function tail(n)
+    if n == 0 then
+        return 0
+    end
+    return tail(n - 1)
+end
+local co = coroutine.wrap(function()
+    while true do
+        coroutine.yield(fib(5))
+    end
+end)
+for i = 1, loop_count do
+    fib(12)
+    concat(20)
+    tail(20)
+    co()
+end
+)";
+
+static const char *coroutine_workload = R"(
+local loop_count, resume = ...
+local co = coroutine.create(function()
+    while true do
+        coroutine.yield()
+    end
+end)
+for i = 1, loop_count do
+    resume(co)
+end
+)";
+
+// resumes without going through the coroutine library, so the profiler has to probe the thread
+static int c_resume(lua_State *L)
+{
+    auto co = lua_tothread(L, 1);
+    lua_resume(co, L, 0);
+    lua_settop(co, 0);
+    return 0;
+}
+
+// runs the workload in a fresh state, start_options nullptr means without profiler
+static double run_hook_workload(const char *workload, const char *start_options, lua_Integer loop_count, const char *resume = "coroutine.resume")
+{
+    auto L = luaL_newstate();
+    luaL_openlibs(L);
+    lua_pushcfunction(L, c_resume);
+    lua_setglobal(L, "c_resume");
+    luaopen_profiler(L);
+    if (start_options != nullptr)
+    {
+        std::string start_code = fmt::format("require(\"profiler\").start({})", start_options);
+        if (luaL_dostring(L, start_code.c_str()))
+        {
+            std::cout << lua_tostring(L, -1) << std::endl;
+        }
+    }
+    luaL_loadstring(L, workload);
+    lua_pushinteger(L, loop_count);
+    lua_getglobal(L, "coroutine");
+    lua_getfield(L, -1, "resume");
+    lua_remove(L, -2);
+    if (std::strcmp(resume, "c_resume") == 0)
+    {
+        lua_pop(L, 1);
+        lua_getglobal(L, "c_resume");
+    }
+    auto begin = steady_clock::now();
+    if (lua_pcall(L, 2, 0, 0))
+    {
+        std::cout << lua_tostring(L, -1) << std::endl;
+    }
+    auto duration = duration_cast<microseconds>(steady_clock::now() - begin);
+    lua_sethook(L, nullptr, 0, 0);
+    lua_close(L);
+    return duration.count() / 1000.0;
+}
+
+static int run_hook_benchmark(int argc, char const *argv[])
+{
+    lua_Integer loop_count = argc > 0 ? std::strtoll(argv[0], nullptr, 10) : 2000;
+    const char *configurations[] = {
+        "{}",
+        "{coroutine=false}",
+        "{tail_call=false}",
+        "{compensation=false}",
+        "{name=false}",
+        "{clock=\"coarse\"}",
+        "{cpu_time=true}",
+        "{perf_counters=true}",
+        "{adaptive=true, sample_time=10, rerank=100}",
+        "{coroutine=false, tail_call=false, compensation=false, name=false, clock=\"coarse\"}",
+    };
+
+    auto baseline_ms = run_hook_workload(hook_workload, nullptr, loop_count);
+    std::cout << fmt::format("{:<90} {:>10.1f} ms", "no profiler", baseline_ms) << std::endl;
+    for (auto &&configuration : configurations)
+    {
+        auto ms = run_hook_workload(hook_workload, configuration, loop_count);
+        std::cout << fmt::format("{:<90} {:>10.1f} ms  x{:.2f}", configuration, ms, ms / baseline_ms) << std::endl;
+    }
+    return 0;
+}
+
+static int run_coroutine_benchmark(int argc, char const *argv[])
+{
+    lua_Integer switch_count = argc > 0 ? std::strtoll(argv[0], nullptr, 10) : 200000;
+    for (auto &&resume : {"coroutine.resume", "c_resume"})
+    {
+        auto baseline_ms = run_hook_workload(coroutine_workload, nullptr, switch_count, resume);
+        auto ms = run_hook_workload(coroutine_workload, "{}", switch_count, resume);
+        std::cout << fmt::format("{:<20} resumes:{:<10} no profiler:{:>10.1f} ms  profiler:{:>10.1f} ms  {:.0f} ns per resume",
+                                 resume, switch_count, baseline_ms, ms, (ms - baseline_ms) * 1000000.0 / switch_count)
+                  << std::endl;
+    }
+    return 0;
+}
+
+template <typename query_t>
+static double measure_query_ms(const std::string &index_file_name, size_t &output_size, query_t &&query)
+{
+    auto begin = steady_clock::now();
+    std::string error;
+    profile_index_reader reader;
+    if (!reader.open(index_file_name, error))
+    {
+        std::cout << error << std::endl;
+        return -1;
+    }
+    rapidjson::StringBuffer buffer;
+    profile_index_writer writer(buffer);
+    query(writer, reader);
+    output_size = buffer.GetSize();
+    return duration_cast<microseconds>(steady_clock::now() - begin).count() / 1000.0;
+}
+
+static int run_index_benchmark(int argc, char const *argv[])
+{
+    size_t node_count = argc > 0 ? std::strtoull(argv[0], nullptr, 10) : 3000000;
+    size_t function_count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : node_count / 4;
+    std::string dump_file_name = "benchmark.lua_profile_json.txt";
+    std::string index_file_name = "benchmark.lua_profile_index";
+
+    {
+        auto pd = new_synthetic_profile(node_count, std::max<size_t>(function_count, 1), 8);
+        auto dump_begin = steady_clock::now();
+        std::ofstream os(dump_file_name);
+        print_profile_json(os, *pd);
+        std::cout << fmt::format("dump nodes:{} functions:{} written in {} ms",
+                                 get_profile_node_count(*pd),
+                                 get_profile_function_count(*pd),
+                                 duration_cast<milliseconds>(steady_clock::now() - dump_begin).count())
+                  << std::endl;
+    }
+
+    std::string error;
+    auto build_begin = steady_clock::now();
+    if (!build_profile_index(dump_file_name, index_file_name, error))
+    {
+        std::cout << error << std::endl;
+        return 1;
+    }
+    std::cout << fmt::format("index built in {} ms", duration_cast<milliseconds>(steady_clock::now() - build_begin).count()) << std::endl;
+
+    // each query opens the index like one run of lua_profiler_index
+    std::pair<const char *, std::function<void(profile_index_writer &, profile_index_reader &)>> queries[] = {
+        {"subtree root depth 1", [](auto &writer, auto &reader) { write_index_subtree(writer, reader, 0, 1, 0); }},
+        {"subtree middle depth 3", [&](auto &writer, auto &reader) { write_index_subtree(writer, reader, static_cast<uint32_t>(reader.header.node_count / 2), 3, 0); }},
+        {"top 20 by total", [](auto &writer, auto &reader) { write_index_top(writer, reader, "total", 20, 0); }},
+        {"top 20 by self offset 1000", [](auto &writer, auto &reader) { write_index_top(writer, reader, "self", 20, 1000); }},
+        {"search \"f1234\" top 20", [](auto &writer, auto &reader) { write_index_search(writer, reader, "f1234", 20); }},
+    };
+    for (auto &&[name, query] : queries)
+    {
+        size_t output_size = 0;
+        auto ms = measure_query_ms(index_file_name, output_size, query);
+        std::cout << fmt::format("{:<30} {:>10.2f} ms  {} bytes", name, ms, output_size) << std::endl;
+    }
+    std::remove(dump_file_name.c_str());
+    std::remove(index_file_name.c_str());
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "report")
+    {
+        return run_report_benchmark(argc - 2, argv + 2);
+    }
+    else if (mode == "hook")
+    {
+        return run_hook_benchmark(argc - 2, argv + 2);
+    }
+    else if (mode == "coroutine")
+    {
+        return run_coroutine_benchmark(argc - 2, argv + 2);
+    }
+    else if (mode == "index")
+    {
+        return run_index_benchmark(argc - 2, argv + 2);
+    }
+    return run_hook_benchmark(0, nullptr) | run_coroutine_benchmark(0, nullptr) | run_report_benchmark(0, nullptr);
+}
@@ -3,11 +3,14 @@
 
 import json
 import math
+import os
+import subprocess
 
 from PySide2.QtCore import Qt
 from PySide2.QtGui import (QBrush, QColor, QDragEnterEvent, QDropEvent,
                            QFontDatabase)
-from PySide2.QtWidgets import QHeaderView, QMainWindow, QTreeWidgetItem
+from PySide2.QtWidgets import (QHeaderView, QMainWindow, QMessageBox,
+                               QTreeWidgetItem)
 
 from json_viewer_window import Ui_MainWindow
 
@@ -26,14 +29,63 @@ HEADER_LABELS = ["Function Name",
                  "Self (nanoseconds)",
                  "Children (nanoseconds)"]
 
+CPU_HEADER_LABELS = ["CPU Total (nanoseconds)",
+                     "CPU Self (nanoseconds)",
+                     "CPU Children (nanoseconds)"]
 
-def init_tree_view(tree_widget):
+TIME_KEYS = ["total_time", "self_time", "children_time"]
+
+CPU_TIME_KEYS = ["cpu_total_time", "cpu_self_time", "cpu_children_time"]
+
+# counters of a profile started with perf_counters = true, in the order of the profiler
+PERF_COUNTER_NAMES = ["instructions", "cycles", "cache_misses", "branch_misses"]
+
+PERF_HEADER_LABELS = [f"{name.replace('_', ' ').title()} {column}"
+                      for name in PERF_COUNTER_NAMES for column in ("Total", "Self")]
+
+PERF_KEYS = [f"{name}_{column}"
+             for name in PERF_COUNTER_NAMES for column in ("total", "self")]
+
+# tool answering queries on *.lua_profile_index files, see lua_profiler_index.cpp
+INDEX_TOOL = os.environ.get("LUA_PROFILER_INDEX", "lua_profiler_index")
+
+# functions listed from an index, the list of a dump has all of them
+INDEX_LIST_TOP = 1000
+
+NODE_ID_ROLE = Qt.UserRole
+NODE_UNLOADED_ROLE = Qt.UserRole + 1
+
+
+class IndexQueryError(Exception):
+    """ the index tool is missing, failed or printed no json """
+
+
+def query_index(command, file_name, *args):
+    """ run a query of the index tool, returns the parsed json """
+    try:
+        result = subprocess.run([INDEX_TOOL, command, file_name] + [str(arg) for arg in args],
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+        return json.loads(result.stdout)
+    except OSError as error:
+        raise IndexQueryError(f"can not run {INDEX_TOOL}: {error}") from error
+    except subprocess.CalledProcessError as error:
+        message = error.stderr.decode(errors="replace").strip()
+        raise IndexQueryError(
+            f"{INDEX_TOOL} {command} failed: {message or error}") from error
+    except ValueError as error:
+        raise IndexQueryError(
+            f"{INDEX_TOOL} {command} printed no json: {error}") from error
+
+
+def init_tree_view(tree_widget, with_cpu_time=False, with_perf_counters=False):
     """ init tree view """
     tree_widget.header().setSectionResizeMode(
         QHeaderView.ResizeToContents)
     tree_widget.header().setSectionsMovable(False)
     tree_widget.header().setSectionsClickable(True)
-    tree_widget.setHeaderLabels(HEADER_LABELS)
+    tree_widget.setHeaderLabels(HEADER_LABELS +
+                                (CPU_HEADER_LABELS if with_cpu_time else []) +
+                                (PERF_HEADER_LABELS if with_perf_counters else []))
 
 
 def get_brush(val, max_val):
@@ -62,11 +114,14 @@ class MainWindow(QMainWindow):
         self.tree_top_item = None
         self.window.treeWidget.itemDoubleClicked.connect(
             on_item_double_clicked)
+        self.window.treeWidget.itemExpanded.connect(self.on_item_expanded)
         self.window.listWidget.header().sectionClicked.connect(
             self.section_clicked)
         self.list_dict = {}
         self.json_dict = {}
         self.total_time = 0
+        self.time_keys = TIME_KEYS
+        self.index_file_name = None
 
     def section_clicked(self, index):
         """ sort section """
@@ -85,11 +140,92 @@ class MainWindow(QMainWindow):
         file_name = url.toLocalFile()
         if file_name.endswith("lua_profile_json.txt"):
             self.handle_json_file(file_name)
+        elif file_name.endswith("lua_profile_index"):
+            self.handle_index_file(file_name)
+
+    def init_columns(self, root):
+        """ columns of the optional times and counters the root node has """
+        with_cpu_time = "cpu_total_time" in root
+        with_perf_counters = PERF_KEYS[0] in root
+        self.time_keys = TIME_KEYS + \
+            (CPU_TIME_KEYS if with_cpu_time else []) + \
+            (PERF_KEYS if with_perf_counters else [])
+        init_tree_view(self.window.treeWidget,
+                       with_cpu_time, with_perf_counters)
+        init_tree_view(self.window.listWidget,
+                       with_cpu_time, with_perf_counters)
+
+    def show_index_error(self, error: IndexQueryError):
+        """ the slots of the window can not raise, tell why the index is not shown """
+        QMessageBox.warning(self, "Lua profile index", str(error))
+
+    def handle_index_file(self, file_name: str):
+        """ show the top of an index, nodes are fetched as they are expanded """
+        try:
+            root = query_index("subtree", file_name, 0, 1)
+            top = query_index("top", file_name, "total", INDEX_LIST_TOP)
+        except IndexQueryError as error:
+            self.show_index_error(error)
+            return
+        self.index_file_name = file_name
+        self.init_columns(root)
+        if self.tree_top_item:
+            root_item = self.window.treeWidget.invisibleRootItem()
+            root_item.removeChild(self.tree_top_item)
+        self.total_time = root["total_time"]
+        self.tree_top_item = self.new_index_item(root)
+        self.window.treeWidget.addTopLevelItem(self.tree_top_item)
+        self.add_index_children(self.tree_top_item, root)
+        self.tree_top_item.setData(0, NODE_UNLOADED_ROLE, False)
+
+        self.list_dict.clear()
+        for function in top["functions"]:
+            self.list_dict[function["function_source"]] = function
+        self.add_list_to_view()
+
+    def new_index_item(self, current):
+        """ item of an index node, with a placeholder child until expanded """
+        item_data = [current["function_name"], str(current["count"])] + \
+            [str(current[key]) for key in self.time_keys]
+        item = QTreeWidgetItem(None, item_data)
+        brush = get_brush(current["total_time"], self.total_time)
+        item.setBackground(0, brush)
+        for column_index in range(1, len(item_data)):
+            item.setTextAlignment(column_index, Qt.AlignRight)
+            item.setBackground(column_index, brush)
+            item.setFont(column_index, self.mono_space_font)
+        item.setData(0, NODE_ID_ROLE, current["id"])
+        item.setData(0, NODE_UNLOADED_ROLE, current["child_count"] > 0)
+        if current["child_count"] > 0:
+            item.addChild(QTreeWidgetItem(None, ["..."]))
+        return item
+
+    def add_index_children(self, item, current):
+        """ replace the placeholder by the children of current """
+        item.takeChildren()
+        for child in current.get("children", []):
+            item.addChild(self.new_index_item(child))
+
+    def on_item_expanded(self, item):
+        """ fetch the children of an index node """
+        if self.index_file_name is None or not item.data(0, NODE_UNLOADED_ROLE):
+            return
+        try:
+            current = query_index("subtree", self.index_file_name,
+                                  item.data(0, NODE_ID_ROLE), 1)
+        except IndexQueryError as error:
+            item.setExpanded(False)  # still unloaded, the next expand queries again
+            self.show_index_error(error)
+            return
+        self.add_index_children(item, current)
+        item.setData(0, NODE_UNLOADED_ROLE, False)
 
     def handle_json_file(self, file_name: str):
         """ read file to json """
+        self.index_file_name = None
         with open(file_name, 'r') as file:
             self.json_dict = json.load(file)
+            self.init_columns(self.json_dict)
             self.handle_dict_to_tree(self.json_dict)
             self.handle_dict_to_list(self.json_dict)
             self.add_list_to_view()
@@ -101,13 +237,10 @@ class MainWindow(QMainWindow):
         for value in self.list_dict.values():
             list_data.append(value)
         for data in list_data:
-            item_data = [data["function_name"],
-                         (data["count"]),
-                         (data["total_time"]),
-                         (data["self_time"]),
-                         (data["children_time"])]
+            item_data = [data["function_name"], (data["count"])] + \
+                [(data[key]) for key in self.time_keys]
             item = QTreeWidgetItem(None, item_data)
-            for column_index in [1, 2, 3, 4]:
+            for column_index in range(1, len(item_data)):
                 item.setTextAlignment(column_index, Qt.AlignRight)
                 item.setBackground(column_index, get_brush(
                     item_data[column_index], self.total_time))
@@ -134,9 +267,8 @@ class MainWindow(QMainWindow):
                     if not current_name.startswith("?"):
                         old_obj["function_name"] = current_name
                 old_obj["count"] += current["count"]
-                old_obj["total_time"] += current["total_time"]
-                old_obj["self_time"] += current["self_time"]
-                old_obj["children_time"] += current["children_time"]
+                for key in self.time_keys:
+                    old_obj[key] += current[key]
             else:
                 if current["function_source"]:
                     new_obj = current.copy()
@@ -165,15 +297,13 @@ class MainWindow(QMainWindow):
                 continue
             while len(item_stack) > current_stack:
                 item_stack.pop()
-            item = QTreeWidgetItem(None, [current["function_name"],
-                                          str(current["count"]),
-                                          str(current["total_time"]),
-                                          str(current["self_time"]),
-                                          str(current["children_time"])])
+            item_data = [current["function_name"], str(current["count"])] + \
+                [str(current[key]) for key in self.time_keys]
+            item = QTreeWidgetItem(None, item_data)
             current_total_time = current["total_time"]
             brush = get_brush(current_total_time, self.total_time)
             item.setBackground(0, brush)
-            for column_index in [1, 2, 3, 4]:
+            for column_index in range(1, len(item_data)):
                 item.setTextAlignment(column_index, Qt.AlignRight)
                 item.setBackground(column_index, brush)
                 item.setFont(column_index, self.mono_space_font)
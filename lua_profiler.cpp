@@ -1,7 +1,11 @@
 
 #include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <chrono>
 #include <unordered_map>
+#include <unordered_set>
 #include <stack>
 #include <functional>
 #include <memory>
@@ -11,6 +15,38 @@
 #include <fmt/format.h>
 #include <lua.hpp>
 #include <thread>
+#include <atomic>
+#include <array>
+#include <utility>
+#include <ctime>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cerrno>
+#include <numeric>
+#include <cstdint>
+#include <random>
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "lua_profiler_shm.h"
+#include "lua_profiler_internal.h"
+#if defined(LUA_PROFILER_WITH_ZLIB)
+#include <zlib.h>
+#endif
 // #include <nlohmann/json.hpp>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
@@ -20,6 +56,262 @@ using namespace std::chrono;
 using record_clock_t = high_resolution_clock;
 using time_point_t = record_clock_t::time_point;
 using time_unit_t = record_clock_t::duration;
+
+// cheaper but only tick (1~4ms) accurate, falls back to steady_clock where unavailable
+struct coarse_clock
+{
+    static time_point_t now()
+    {
+#if defined(CLOCK_MONOTONIC_COARSE)
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return time_point_t(duration_cast<time_unit_t>(seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec)));
+#else
+        return time_point_t(duration_cast<time_unit_t>(steady_clock::now().time_since_epoch()));
+#endif
+    }
+};
+
+// cpu time consumed by the calling thread, zero where unavailable
+struct thread_cpu_clock
+{
+    static time_point_t now()
+    {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return time_point_t(duration_cast<time_unit_t>(seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec)));
+#elif defined(_WIN32)
+        FILETIME creation_time, exit_time, kernel_time, user_time;
+        GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time);
+        auto to_100ns = [](const FILETIME &t) { return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+        return time_point_t(duration_cast<time_unit_t>(duration<uint64_t, std::ratio<1, 10000000>>(to_100ns(kernel_time) + to_100ns(user_time))));
+#else
+        return {};
+#endif
+    }
+};
+enum perf_counter_index : size_t
+{
+    perf_instructions,
+    perf_cycles,
+    perf_cache_misses,
+    perf_branch_misses,
+    perf_counter_count,
+};
+
+static const char *perf_counter_names[perf_counter_count] = {"instructions", "cycles", "cache_misses", "branch_misses"};
+static_assert(perf_counter_count == shm_profile_counter_count, "live export layout has a column per counter");
+
+struct perf_counter_values
+{
+    std::array<int64_t, perf_counter_count> values = {};
+
+    perf_counter_values &operator+=(const perf_counter_values &other)
+    {
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            values[i] += other.values[i];
+        }
+        return *this;
+    }
+
+    perf_counter_values &operator-=(const perf_counter_values &other)
+    {
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            values[i] -= other.values[i];
+        }
+        return *this;
+    }
+
+    friend perf_counter_values operator+(perf_counter_values l, const perf_counter_values &r)
+    {
+        return l += r;
+    }
+
+    friend perf_counter_values operator-(perf_counter_values l, const perf_counter_values &r)
+    {
+        return l -= r;
+    }
+};
+
+// hardware counters of the calling os thread, one perf_event_open group. each counter has its
+// perf_event_mmap_page mapped, on x86 with cap_user_rdpmc they are read with rdpmc in user space,
+// otherwise the group is read with a single read(2). counters the machine or container does not
+// allow stay 0, without instructions nothing is read
+class perf_counters
+{
+public:
+    static perf_counters &current()
+    {
+        static thread_local perf_counters counters;
+        return counters;
+    }
+
+    ~perf_counters()
+    {
+#if defined(__linux__)
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            if (pages[i] != nullptr)
+            {
+                munmap(const_cast<perf_event_mmap_page *>(pages[i]), page_size);
+            }
+            if (fds[i] >= 0)
+            {
+                ::close(fds[i]);
+            }
+        }
+#endif
+    }
+
+    bool open(std::string &error)
+    {
+        if (is_opened)
+        {
+            return true;
+        }
+#if defined(__linux__)
+        static const std::pair<uint32_t, uint64_t> events[perf_counter_count] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        };
+        size_t member_count = 0;
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.disabled = i == 0 ? 1 : 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            int fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, fds[0], 0));
+            if (fd < 0 && i == 0)
+            {
+                error = fmt::format("perf_event_open failed: {}", std::strerror(errno));
+                return false;
+            }
+            fds[i] = fd;
+            slots[i] = fd < 0 ? -1 : static_cast<int>(member_count++);
+        }
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        is_opened = true;
+#if defined(__x86_64__) || defined(__i386__)
+        page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        is_rdpmc = true;
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            if (fds[i] < 0)
+            {
+                continue;
+            }
+            auto page = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fds[i], 0);
+            pages[i] = page == MAP_FAILED ? nullptr : static_cast<const perf_event_mmap_page *>(page);
+            is_rdpmc = is_rdpmc && pages[i] != nullptr && pages[i]->cap_user_rdpmc != 0;
+        }
+#endif
+        return true;
+#else
+        error = "perf counters need linux";
+        return false;
+#endif
+    }
+
+    perf_counter_values read() const
+    {
+        perf_counter_values result;
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+        if (is_rdpmc)
+        {
+            for (size_t i = 0; i < perf_counter_count; ++i)
+            {
+                if (pages[i] != nullptr)
+                {
+                    result.values[i] = read_page(*pages[i]);
+                }
+            }
+            return result;
+        }
+#endif
+#if defined(__linux__)
+        struct
+        {
+            uint64_t count;
+            uint64_t values[perf_counter_count];
+        } group = {};
+        if (is_opened && ::read(fds[0], &group, sizeof(group)) > 0)
+        {
+            for (size_t i = 0; i < perf_counter_count; ++i)
+            {
+                if (slots[i] >= 0 && static_cast<uint64_t>(slots[i]) < group.count)
+                {
+                    result.values[i] = static_cast<int64_t>(group.values[slots[i]]);
+                }
+            }
+        }
+#endif
+        return result;
+    }
+
+    bool is_counting(size_t index) const
+    {
+        return is_opened && slots[index] >= 0;
+    }
+
+    const char *get_read_method() const
+    {
+#if defined(__linux__)
+        return is_rdpmc ? "rdpmc" : "read";
+#else
+        return "none";
+#endif
+    }
+
+private:
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+    // the page is consistent when lock did not change while reading it, the counter is offset
+    // plus the pmc_width bits of the hardware counter while it is scheduled (index > 0)
+    static int64_t read_page(const volatile perf_event_mmap_page &page)
+    {
+        uint32_t lock = 0;
+        int64_t count = 0;
+        do
+        {
+            lock = page.lock;
+            std::atomic_signal_fence(std::memory_order_acq_rel);
+            uint32_t index = page.index;
+            count = page.offset;
+            if (index > 0)
+            {
+                uint32_t low = 0;
+                uint32_t high = 0;
+                __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(index - 1));
+                auto shift = 64 - page.pmc_width;
+                count += static_cast<int64_t>((uint64_t(high) << 32 | low) << shift) >> shift;
+            }
+            std::atomic_signal_fence(std::memory_order_acq_rel);
+        } while (page.lock != lock);
+        return count;
+    }
+#endif
+
+    bool is_opened = false;
+    std::array<int, perf_counter_count> fds = {-1, -1, -1, -1};
+    std::array<int, perf_counter_count> slots = {-1, -1, -1, -1}; // position in the group read
+#if defined(__linux__)
+    bool is_rdpmc = false; // every counting page allows rdpmc
+    size_t page_size = 0;
+    std::array<const perf_event_mmap_page *, perf_counter_count> pages = {}; // mapped by open on x86
+#endif
+};
+
 // using json = nlohmann::json;
 
 static lua_State *get_main_thread(lua_State *L)
@@ -90,6 +382,53 @@ struct scope_on_exit
         }
     }
 };
+// per frame part of function_time_data, see frame_recorder
+struct frame_time_data
+{
+    uint64_t count = 0;
+    time_unit_t self_time = {};
+    time_unit_t total_time = {};
+    time_unit_t cpu_self_time = {};
+    time_unit_t cpu_total_time = {};
+    perf_counter_values perf_self;
+    perf_counter_values perf_total;
+
+    frame_time_data &operator+=(const frame_time_data &other)
+    {
+        count += other.count;
+        self_time += other.self_time;
+        total_time += other.total_time;
+        cpu_self_time += other.cpu_self_time;
+        cpu_total_time += other.cpu_total_time;
+        perf_self += other.perf_self;
+        perf_total += other.perf_total;
+        return *this;
+    }
+
+    friend frame_time_data operator-(const frame_time_data &l, const frame_time_data &r)
+    {
+        return {l.count - r.count, l.self_time - r.self_time, l.total_time - r.total_time,
+                l.cpu_self_time - r.cpu_self_time, l.cpu_total_time - r.cpu_total_time,
+                l.perf_self - r.perf_self, l.perf_total - r.perf_total};
+    }
+};
+
+// thread cpu clock columns of a node, start{cpu_time = true}
+struct cpu_time_data
+{
+    time_unit_t self_time = {};
+    time_unit_t children_time = {};
+    time_unit_t total_time = {};
+};
+
+// hardware counter columns of a node, start{perf_counters = true}
+struct perf_counter_data
+{
+    perf_counter_values self;
+    perf_counter_values children;
+    perf_counter_values total;
+};
+
 struct function_time_data
 {
     std::unordered_map<std::string, function_time_data_t> children;
@@ -99,55 +438,115 @@ struct function_time_data
     time_unit_t children_time = {};
     time_unit_t total_time = {};
     uint64_t count = 0;
+    size_t stack_depth = 0;
+    function_time_data *parent = nullptr;
+    function_time_data *source_data = nullptr; // aggregate of all nodes with the same function_source
+    // columns of the optional clocks, allocated by their first record so other profiles do not carry them,
+    // the data of other features lives in their own side tables keyed by node
+    std::unique_ptr<cpu_time_data> cpu_time;
+    std::unique_ptr<perf_counter_data> perf_counters;
+
+    cpu_time_data &record_cpu_time()
+    {
+        if (!cpu_time)
+        {
+            cpu_time = std::make_unique<cpu_time_data>();
+        }
+        return *cpu_time;
+    }
+
+    perf_counter_data &record_perf_counters()
+    {
+        if (!perf_counters)
+        {
+            perf_counters = std::make_unique<perf_counter_data>();
+        }
+        return *perf_counters;
+    }
+
+    // zeros for nodes without the columns
+    const cpu_time_data &get_cpu_time() const
+    {
+        static const cpu_time_data none;
+        return cpu_time ? *cpu_time : none;
+    }
+
+    const perf_counter_data &get_perf_counters() const
+    {
+        static const perf_counter_data none;
+        return perf_counters ? *perf_counters : none;
+    }
 };
 
+static frame_time_data get_frame_time_data(const function_time_data &data)
+{
+    auto &cpu = data.get_cpu_time();
+    auto &perf = data.get_perf_counters();
+    return {data.count, data.self_time, data.total_time, cpu.self_time, cpu.total_time, perf.self, perf.total};
+}
+
 template <sort_t sort_type = sort_t::self_time>
-bool function_time_data_sort(const function_time_data_t &l, const function_time_data_t &r)
+time_unit_t function_time_data_sort_key(const function_time_data *data)
 {
-    return l->self_time < r->self_time;
+    return data->self_time;
 }
 
 template <>
-bool function_time_data_sort<sort_t::children_time>(const function_time_data_t &l, const function_time_data_t &r)
+time_unit_t function_time_data_sort_key<sort_t::children_time>(const function_time_data *data)
 {
-    return l->children_time < r->children_time;
+    return data->children_time;
 }
 
 template <>
-bool function_time_data_sort<sort_t::total_time>(const function_time_data_t &l, const function_time_data_t &r)
+time_unit_t function_time_data_sort_key<sort_t::total_time>(const function_time_data *data)
 {
-    return l->total_time < r->total_time;
+    return data->total_time;
 }
 
 template <>
-bool function_time_data_sort<sort_t::add_time>(const function_time_data_t &l, const function_time_data_t &r)
+time_unit_t function_time_data_sort_key<sort_t::add_time>(const function_time_data *data)
+{
+    return data->self_time + data->children_time;
+}
+
+template <sort_t sort_type = sort_t::self_time>
+bool function_time_data_sort(const function_time_data *l, const function_time_data *r)
 {
-    return l->self_time + l->children_time < r->self_time + r->children_time;
+    auto l_key = function_time_data_sort_key<sort_type>(l);
+    auto r_key = function_time_data_sort_key<sort_type>(r);
+    if (l_key != r_key)
+    {
+        return l_key < r_key;
+    }
+    return l->function_name < r->function_name; // names are unique among siblings, keeps ties in a stable order
 }
-using on_traverse_function = std::function<void(function_time_data_t & /*current*/, size_t /*current_stack*/)>;
 
 template <sort_t sort_type>
-static void traverse_tree(function_time_data_t &root, size_t max_stack, on_traverse_function on_traverse)
+static void sort_children(function_time_data &current, std::vector<function_time_data *> &sorted_children)
+{
+    sorted_children.clear();
+    sorted_children.reserve(current.children.size());
+    for (auto &&child : current.children)
+    {
+        sorted_children.push_back(child.second.get());
+    }
+    std::sort(sorted_children.begin(), sorted_children.end(), function_time_data_sort<sort_type>);
+}
+
+// on_traverse : void(function_time_data & /*current*/, size_t /*current_stack*/)
+template <sort_t sort_type, typename on_traverse_t>
+static void traverse_tree(function_time_data &root, size_t max_stack, on_traverse_t &&on_traverse, size_t root_stack = 0)
 {
-    std::stack<function_time_data_t> stack;
-    size_t current_stack = 0;
-    stack.push(root);
+    std::vector<std::pair<function_time_data *, size_t>> stack;
+    std::vector<function_time_data *> sortable_children;
+    stack.emplace_back(&root, root_stack);
 
     while (!stack.empty())
     {
-        auto current = stack.top();
-        stack.pop();
-
-        if (current == nullptr)
-        {
-            --current_stack;
-            continue;
-        }
+        auto [current, current_stack] = stack.back();
+        stack.pop_back();
 
-        if (on_traverse != nullptr)
-        {
-            on_traverse(current, current_stack);
-        }
+        on_traverse(*current, current_stack);
 
         if (current->children.empty())
         {
@@ -159,766 +558,4204 @@ static void traverse_tree(function_time_data_t &root, size_t max_stack, on_trave
             continue;
         }
 
-        stack.push(nullptr);
-        ++current_stack;
-
         if constexpr (sort_type == sort_t::none)
         {
             for (auto &&child : current->children)
             {
-                stack.push(child.second);
+                stack.emplace_back(child.second.get(), current_stack + 1);
             }
         }
         else
         {
-            std::vector<function_time_data_t> sortable_children;
-            sortable_children.reserve(current->children.size());
-            for (auto &&child : current->children)
-            {
-                sortable_children.push_back(child.second);
-            }
-            std::sort(sortable_children.begin(), sortable_children.end(), function_time_data_sort<sort_type>);
+            // pushed ascending, so visited descending
+            sort_children<sort_type>(*current, sortable_children);
             for (auto &&i : sortable_children)
             {
-                stack.push(i);
+                stack.emplace_back(i, current_stack + 1);
             }
         }
     }
 }
 
-struct function_stack_node
-{
-    std::string function_name = "";
-    std::string function_source = "";
-    time_point_t call_begin_time = {};
-    time_point_t call_end_time = {};
-    time_point_t last_record_time = {};
-    time_point_t new_thread_begin_time = {};
-    time_unit_t children_tool_time = {};
-    time_unit_t children_pure_time = {};
-    time_unit_t children_coroutine_time = {};
-    function_time_data_t node = nullptr;
-    bool is_tail_call = false;
-};
+static size_t report_thread_count = 0;          // 0 means std::thread::hardware_concurrency()
+static size_t parallel_report_min_size = 1 << 16; // smaller reports are not worth starting threads
 
-using function_stack_t = std::stack<function_stack_node>;
+static size_t get_report_thread_count(size_t report_size)
+{
+    if (report_size < parallel_report_min_size)
+    {
+        return 1;
+    }
+    size_t thread_count = report_thread_count > 0 ? report_thread_count : std::thread::hardware_concurrency();
+    return std::max<size_t>(thread_count, 1);
+}
 
-static void calculate_time(function_stack_t &data_stack, const time_point_t &begin_time, bool &is_tail_call_popped)
+template <typename job_t>
+static void parallel_for(size_t job_count, size_t thread_count, job_t &&job)
 {
-    auto &current_top = data_stack.top();
-    // this_all = this_tool_time + children + children_tool_time + self
-    // this_sub = children_tooltime + self + children
-    auto tool_total_time = current_top.call_end_time - current_top.call_begin_time + current_top.children_tool_time;
-    auto coroutine_time = current_top.children_coroutine_time;
-    auto sub_time = begin_time - current_top.call_end_time;
-    auto pure_sub_time = sub_time - current_top.children_tool_time - coroutine_time;
-    auto self_time = pure_sub_time - current_top.children_pure_time;
-    current_top.node->children_time += current_top.children_pure_time;
-    current_top.node->self_time += self_time;
-    is_tail_call_popped = current_top.is_tail_call;
-    data_stack.pop();
-    if (!data_stack.empty())
+    thread_count = std::min(thread_count, job_count);
+    if (thread_count <= 1)
     {
-        auto &top = data_stack.top();
-        top.children_tool_time += tool_total_time;
-        top.children_pure_time += pure_sub_time;
-        top.children_coroutine_time += coroutine_time;
+        for (size_t i = 0; i < job_count; ++i)
+        {
+            job(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next_job = 0;
+    auto worker = [&]() {
+        for (size_t i = next_job++; i < job_count; i = next_job++)
+        {
+            job(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (size_t i = 1; i < thread_count; ++i)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &&t : threads)
+    {
+        t.join();
     }
 }
 
-static size_t per_indent_length = 4;
-static size_t space_after_name = 4;
+// sorts chunks concurrently then merges them pairwise, compare must be a strict total order
+// so the result is identical to std::sort
+template <typename iterator_t, typename compare_t>
+static void parallel_sort(iterator_t begin, iterator_t end, size_t thread_count, compare_t compare)
+{
+    size_t size = static_cast<size_t>(end - begin);
+    size_t chunk_count = std::min(thread_count, size / 4096 + 1);
+    if (chunk_count <= 1)
+    {
+        std::sort(begin, end, compare);
+        return;
+    }
 
-static const char *profile_data_metatable_name = "profile_data_metatable";
-static const char *coroutine_stack_metatable_name = "coroutine_stack_metatable";
-static const char *weak_table_metatable_name = "profile_data_weak_table_metatable";
+    std::vector<size_t> bounds(chunk_count + 1);
+    for (size_t i = 0; i <= chunk_count; ++i)
+    {
+        bounds[i] = size * i / chunk_count;
+    }
+    parallel_for(chunk_count, thread_count, [&](size_t i) {
+        std::sort(begin + bounds[i], begin + bounds[i + 1], compare);
+    });
+    for (size_t width = 1; width < chunk_count; width *= 2)
+    {
+        size_t merge_count = (chunk_count + 2 * width - 1) / (2 * width);
+        parallel_for(merge_count, thread_count, [&](size_t i) {
+            size_t low = i * 2 * width;
+            size_t middle = std::min(low + width, chunk_count);
+            size_t high = std::min(low + 2 * width, chunk_count);
+            if (middle < high)
+            {
+                std::inplace_merge(begin + bounds[low], begin + bounds[middle], begin + bounds[high], compare);
+            }
+        });
+    }
+}
 
-struct coroutine_stack_userdata
+struct frame_record
 {
-    function_stack_t coroutine_stack;
-    std::string coroutine_name;
-    std::weak_ptr<struct profile_data> pd;
+    function_time_data *node = nullptr;
+    frame_time_data data = {};
 };
 
-static int coroutine_stack_userdata_gc(lua_State *L);
-
-struct profile_data : std::enable_shared_from_this<profile_data>
+struct frame_data
 {
-    function_time_data_t root = std::make_shared<function_time_data>();
-    function_stack_t main_thread_stack;
-    lua_State *last_thread_of_hook = nullptr;
-    lua_State *main_thread = nullptr;
-    time_point_t last_tool_begin = {};
-    time_point_t last_tool_end = {};
+    uint64_t index = 0;
+    time_unit_t duration = {};
+    std::vector<frame_record> records;
 
-    bool is_main_thread(lua_State *L) const
+    void copy_from(const frame_data &other)
     {
-        return main_thread == L;
+        index = other.index;
+        duration = other.duration;
+        records.assign(other.records.begin(), other.records.end()); // reuses capacity
     }
+};
+
+// frame_recorder state of a node or a source aggregate
+struct frame_node_data
+{
+    uint64_t touched = 0;       // frame index this node was last touched in
+    frame_time_data base = {};  // values at the last frame mark
+    frame_time_data sum = {};   // sum of all closed frames
+};
+
+// profiler.frame_mark() closes a frame: nodes touched since the last mark have their deltas recorded
+// into a preallocated ring of recent frames, frames over budget are copied aside as spikes
+struct frame_recorder
+{
+    bool is_enabled = false;
+    uint64_t frame_index = 0;
+    uint64_t frame_count = 0;
+    time_point_t last_mark_time = {};
+    time_unit_t total_duration = {};
+    time_unit_t budget = {}; // 0 means no spike capture
+    bool is_dump = false;    // write spikes to file when they happen
+    std::vector<function_time_data *> touched_nodes;
+    std::vector<frame_data> history;
+    size_t next_history = 0;
+    std::vector<frame_data> spikes;
+    size_t next_spike = 0;
+    uint64_t spike_count = 0;
+    frame_data worst;
+    std::unordered_map<const function_time_data *, frame_node_data> nodes;
 
-    std::string get_coroutine_name(lua_State *L)
+    void touch(function_time_data &node)
     {
-        if (is_main_thread(L))
+        if (auto &data = nodes[&node]; data.touched != frame_index)
         {
-            return "mainthread";
+            data.touched = frame_index;
+            touched_nodes.push_back(&node);
         }
-        auto top = lua_gettop(L);
-        scope_on_exit _([L, top]() {
-            lua_settop(L, top);
-        });
+    }
 
-        lua_rawgetp(L, LUA_REGISTRYINDEX, reg_key());
-        lua_getuservalue(L, -1);
-        lua_pushthread(L);
-        lua_rawget(L, -2);
+    // sum of the closed frames, zeros for nodes never touched
+    const frame_time_data &get_sum(const function_time_data &node) const
+    {
+        static const frame_time_data none;
+        auto itr = nodes.find(&node);
+        return itr == nodes.end() ? none : itr->second.sum;
+    }
 
-        if (lua_isuserdata(L, -1))
+    void configure(size_t history_size, size_t spike_size, size_t reserved_records)
+    {
+        history.resize(std::max<size_t>(history_size, 1));
+        spikes.resize(spike_size);
+        next_history = 0;
+        next_spike = 0;
+        touched_nodes.reserve(reserved_records);
+        worst.records.reserve(reserved_records);
+        for (auto &&frame : history)
         {
-            auto ud = static_cast<coroutine_stack_userdata *>(luaL_checkudata(L, -1, coroutine_stack_metatable_name));
-            if (!ud->coroutine_name.empty())
-            {
-                return ud->coroutine_name;
-            }
+            frame.records.reserve(reserved_records);
+        }
+        for (auto &&frame : spikes)
+        {
+            frame.records.reserve(reserved_records);
         }
-        return "coroutine:[?]";
     }
 
-    void calculate_total_time(size_t max_stack)
+    // returns the closed frame, nullptr for the first mark which only starts recording
+    const frame_data *mark(function_time_data &root, const time_point_t &now, bool &is_spike)
     {
-        traverse_tree<sort_t::none>(root, max_stack, [](function_time_data_t &current, size_t current_stack) {
-            current->total_time = current->self_time + current->children_time;
-        });
-        std::stack<function_time_data_t> stack;
-        stack.push(root);
-        while (!stack.empty())
+        is_spike = false;
+        if (!is_enabled)
         {
-            auto &current = stack.top();
-            stack.pop();
-
-            for (auto &&child : current->children)
+            if (history.empty())
             {
-                stack.push(child.second);
+                configure(120, 16, 256);
             }
+            traverse_tree<sort_t::none>(root, 0, [&](function_time_data &current, size_t) {
+                nodes[&current].base = get_frame_time_data(current);
+            });
+            is_enabled = true;
+            frame_index = 1;
+            last_mark_time = now;
+            return nullptr;
         }
-    }
 
-    void calculate_root_time(size_t max_stack)
-    {
-        calculate_total_time(max_stack);
-        root->children_time = {};
-        for (auto &&i : root->children)
+        auto &frame = history[next_history];
+        next_history = (next_history + 1) % history.size();
+        frame.index = frame_index;
+        frame.duration = now - last_mark_time;
+        frame.records.clear();
+        for (auto &&node : touched_nodes)
         {
-            root->children_time += i.second->total_time;
+            auto &data = nodes[node];
+            auto values = get_frame_time_data(*node);
+            auto delta = values - data.base;
+            data.base = values;
+            data.sum += delta;
+            if (node->source_data != nullptr)
+            {
+                nodes[node->source_data].sum += delta;
+            }
+            frame.records.push_back({node, delta});
         }
-        root->total_time = root->children_time;
-    }
+        touched_nodes.clear();
 
-    function_stack_t &get_function_data_stack(lua_State *L, std::string *name = nullptr)
-    {
-        if (is_main_thread(L))
+        ++frame_index;
+        ++frame_count;
+        total_duration += frame.duration;
+        last_mark_time = now;
+        if (frame.duration > worst.duration)
         {
-            return main_thread_stack;
+            worst.copy_from(frame);
         }
-        auto top = lua_gettop(L);
-        scope_on_exit _([L, top]() {
-            lua_settop(L, top);
-        });
-        lua_rawgetp(L, LUA_REGISTRYINDEX, reg_key());
-        lua_getuservalue(L, -1);
-        lua_pushthread(L);
-        lua_rawget(L, -2);
+        if (budget.count() > 0 && frame.duration > budget)
+        {
+            is_spike = true;
+            ++spike_count;
+            if (!spikes.empty())
+            {
+                spikes[next_spike].copy_from(frame);
+                next_spike = (next_spike + 1) % spikes.size();
+            }
+        }
+        return &frame;
+    }
+};
+
+static size_t per_indent_length = 4;
+static size_t space_after_name = 4;
+
+// writes files on a background thread so the hook never waits for the disk nor for formatting
+class async_file_writer
+{
+public:
+    // one writer thread for every profile, started by the first write
+    static async_file_writer &shared()
+    {
+        static async_file_writer writer;
+        return writer;
+    }
 
-        if (lua_isuserdata(L, -1))
+    ~async_file_writer()
+    {
         {
-            auto ud = static_cast<coroutine_stack_userdata *>(luaL_checkudata(L, -1, coroutine_stack_metatable_name));
-            return ud->coroutine_stack;
+            std::lock_guard<std::mutex> lock(mutex);
+            is_stopping = true;
         }
-        else
+        condition.notify_one();
+        if (writer.joinable())
         {
-            if (name == nullptr)
-            {
-                static function_stack_t dummy;
-                return dummy;
-            }
-            lua_pop(L, 1);
-            lua_pushthread(L);
-            auto ud = new (lua_newuserdata(L, sizeof(coroutine_stack_userdata))) coroutine_stack_userdata();
-            ud->coroutine_name = fmt::format("coroutine:{}", *name);
-            ud->pd = weak_from_this();
+            writer.join();
+        }
+    }
 
-            if (luaL_newmetatable(L, coroutine_stack_metatable_name))
+    // make_content runs on the writer thread, it must only use data it owns
+    void write(std::string file_name, std::function<std::string()> make_content)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            files.emplace_back(std::move(file_name), std::move(make_content));
+            if (!writer.joinable())
             {
-                lua_pushstring(L, "__gc");
-                lua_pushcfunction(L, coroutine_stack_userdata_gc);
-                lua_rawset(L, -3);
+                writer = std::thread([this]() { run(); });
             }
-            lua_setmetatable(L, -2);
-            assert(lua_istable(L, -3));
-            assert(lua_isthread(L, -2));
-            assert(lua_isuserdata(L, -1));
-            lua_rawset(L, -3);
-            return ud->coroutine_stack;
         }
+        condition.notify_one();
     }
 
-    static const void *reg_key()
+private:
+    void run()
     {
-        static char c;
-        return &c;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            condition.wait(lock, [this]() { return is_stopping || !files.empty(); });
+            if (files.empty())
+            {
+                return;
+            }
+            auto file = std::move(files.front());
+            files.pop_front();
+            lock.unlock();
+            auto content = file.second();
+            std::ofstream os(file.first);
+            os.write(content.data(), content.size());
+            os.close();
+            lock.lock();
+        }
     }
 
-    size_t get_max_function_name_length(size_t max_stack)
-    {
-        size_t max_function_name_length = 0;
-        traverse_tree<sort_t::none>(root, max_stack, [&](function_time_data_t &current, size_t current_statck) {
-            max_function_name_length = std::max(max_function_name_length,
-                                                (current->function_name.length() + current_statck * per_indent_length));
-        });
-        return max_function_name_length;
-    }
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::pair<std::string, std::function<std::string()>>> files;
+    std::thread writer;
+    bool is_stopping = false;
 };
 
-struct profile_data_userdata
+enum flight_event_type : uint8_t
 {
-    std::shared_ptr<profile_data> pd = nullptr;
+    flight_call,
+    flight_return,
 };
 
-static int profile_data_gc(lua_State *L)
+struct flight_event
 {
-    auto pdptr = static_cast<profile_data_userdata *>(lua_touserdata(L, -1));
-    pdptr->pd = nullptr;
-    return 0;
-}
+    const function_time_data *node = nullptr;
+    time_point_t time = {};
+    time_unit_t duration = {}; // pure time of the call for returns
+    flight_event_type type = flight_call;
+};
 
-static int coroutine_stack_userdata_gc(lua_State *L)
+// the ring events of a slow call as they were, names and depths are read from the nodes when
+// the trace is formatted, the tree is kept for that after a clear()
+struct flight_trace
 {
-    auto ud = static_cast<coroutine_stack_userdata *>(luaL_checkudata(L, -1, coroutine_stack_metatable_name));
-    if (!ud->pd.expired())
-    {
-        auto &coroutine_stack = ud->coroutine_stack;
-        bool is_tail_call_popped = false;
+    uint64_t index = 0;
+    flight_event slow_call = {}; // its return
+    time_unit_t threshold = {};
+    std::vector<flight_event> events; // oldest first
+    std::shared_ptr<const function_time_data> tree;
+};
 
-        time_point_t begin_time = {};
-        if (!coroutine_stack.empty())
+// text of a trace, formatted when it is read or dumped instead of when it is captured
+static std::string format_flight_trace(const flight_trace &trace)
+{
+    std::string out;
+    fmt::format_to(std::back_inserter(out), "slow call {} duration:{} threshold:{} (trace {})\n",
+                   trace.slow_call.node->function_name, trace.slow_call.duration.count(), trace.threshold.count(), trace.index);
+    if (trace.events.empty())
+    {
+        return out;
+    }
+    auto first_time = trace.events.front().time;
+    size_t min_depth = SIZE_MAX;
+    for (auto &&event : trace.events)
+    {
+        min_depth = std::min(min_depth, event.node->stack_depth);
+    }
+    for (auto &&event : trace.events)
+    {
+        size_t intent_length = (event.node->stack_depth - min_depth) * per_indent_length;
+        if (event.type == flight_call)
         {
-            begin_time = coroutine_stack.top().last_record_time;
+            fmt::format_to(std::back_inserter(out), "{:<16} call   {:{}}{}\n",
+                           (event.time - first_time).count(), "", intent_length, event.node->function_name);
         }
-
-        while (!coroutine_stack.empty())
+        else
         {
-            calculate_time(coroutine_stack, begin_time, is_tail_call_popped);
+            bool is_slow_call = event.node == trace.slow_call.node && event.time == trace.slow_call.time;
+            fmt::format_to(std::back_inserter(out), "{:<16} return {:{}}{} duration:{}{}\n",
+                           (event.time - first_time).count(), "", intent_length, event.node->function_name,
+                           event.duration.count(), is_slow_call ? " <-- slow" : "");
         }
     }
-    ud->~coroutine_stack_userdata();
-
-    return 0;
+    return out;
 }
 
-static void Log(lua_State *L, std::string &str)
+// flight recorder: every call and return goes into a fixed size ring, a return slower than
+// its threshold freezes the ring once `after` more events are in, as a detailed trace
+struct flight_recorder
 {
-    lua_getglobal(L, "log");
-    lua_pushstring(L, str.c_str());
-    lua_call(L, 1, 0);
-}
+    bool is_enabled = false;
+    time_unit_t threshold = {}; // global, 0 means only functions with their own threshold
+    std::unordered_map<std::string, time_unit_t> function_thresholds; // by function_source
+    size_t after = 64;
+    size_t max_traces = 16;
+    bool is_dump = true;
+    std::vector<flight_event> ring;
+    size_t next_event = 0;
+    size_t event_count = 0; // saturates at ring size
+    // the pending slow call, waiting for its following events
+    flight_event pending = {};
+    time_unit_t pending_threshold = {};
+    size_t pending_after = 0;
+    bool is_pending = false;
+    std::unordered_map<const function_time_data *, time_unit_t> source_thresholds; // function_thresholds by source data
+    uint64_t trace_count = 0;
+    std::deque<std::shared_ptr<flight_trace>> traces; // shared with the pending dumps
+    std::vector<std::shared_ptr<flight_trace>> spare_traces; // with room for a full ring, taken by freeze
+    std::shared_ptr<const function_time_data> tree; // of the nodes in the ring
 
-static std::shared_ptr<profile_data> get_or_new_pd_from_lua(lua_State *L)
-{
-    auto top = lua_gettop(L);
-    std::shared_ptr<profile_data> pd;
-    lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
-    if (lua_isnil(L, -1))
+    void configure(size_t window_size)
     {
-        lua_pop(L, 1);
-        auto dataptr = new (lua_newuserdata(L, sizeof(profile_data_userdata))) profile_data_userdata();
-        pd = std::make_shared<profile_data>();
-        dataptr->pd = pd;
-        if (luaL_newmetatable(L, profile_data_metatable_name))
-        {
-            lua_pushcfunction(L, profile_data_gc);
-            lua_setfield(L, -2, "__gc");
-        }
-        lua_setmetatable(L, -2);
-        lua_newtable(L); // uservalue for coroutine stack map
-        if (luaL_newmetatable(L, weak_table_metatable_name))
+        ring.assign(std::max<size_t>(window_size, 2), {});
+        next_event = 0;
+        event_count = 0;
+        is_pending = false;
+        after = std::min(after, ring.size() - 1);
+        // the kept traces, the one frozen next and the one a dump may still be writing
+        spare_traces.resize(max_traces + 2);
+        for (auto &&trace : spare_traces)
         {
-            lua_pushstring(L, "__mode");
-            lua_pushstring(L, "k");
-            lua_rawset(L, -3);
+            if (trace == nullptr)
+            {
+                trace = std::make_shared<flight_trace>();
+            }
+            trace->events.reserve(ring.size());
         }
-        lua_setmetatable(L, -2);
-        lua_setuservalue(L, -2);
-
-        lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
-        pd->last_thread_of_hook = L;
-        pd->main_thread = get_main_thread(L);
     }
-    else
+
+    // ring and spare traces are released, the captured traces are kept for slow_calls()
+    void disable()
     {
-        auto dataptr = (profile_data_userdata *)lua_touserdata(L, -1);
-        pd = dataptr->pd;
-        lua_pop(L, 1);
+        is_enabled = false;
+        is_pending = false;
+        ring = {};
+        next_event = 0;
+        event_count = 0;
+        spare_traces.clear();
     }
-    assert(lua_gettop(L) == top);
-    return pd;
-}
 
-struct auto_time
-{
-    time_point_t begin_time;
-    lua_State *L;
-    std::string function_name = "";
-    std::string function_source = "";
-    int event = -1;
-    // bool is_tail_call = false;
+    time_unit_t get_threshold(const std::string &function_source) const
+    {
+        if (function_thresholds.empty())
+        {
+            return {};
+        }
+        auto itr = function_thresholds.find(function_source);
+        return itr == function_thresholds.end() ? time_unit_t{} : itr->second;
+    }
 
-    auto_time(lua_State *_L)
+    void record(const function_time_data &node, const time_point_t &time, time_unit_t duration, flight_event_type type)
     {
-        begin_time = record_clock_t::now();
-        L = _L;
+        ring[next_event] = {&node, time, duration, type};
+        next_event = next_event + 1 == ring.size() ? 0 : next_event + 1;
+        event_count = std::min(event_count + 1, ring.size());
+        if (is_pending && pending_after-- == 0)
+        {
+            freeze();
+        }
     }
-    ~auto_time()
+
+    void on_call(const function_time_data &node, const time_point_t &time)
     {
-        static int auto_inc_index = 1;
-        auto_inc_index++;
-        std::shared_ptr<profile_data> pd = get_or_new_pd_from_lua(L);
-        scope_on_exit _([&]() {
-            pd->last_thread_of_hook = L;
+        record(node, time, {}, flight_call);
+    }
 
-            if (function_name.empty() || event == LUA_HOOKRET)
+    void on_return(const function_time_data &node, const time_point_t &time, time_unit_t duration)
+    {
+        auto slow_threshold = threshold;
+        if (!function_thresholds.empty() && node.source_data != nullptr)
+        {
+            auto [itr, is_new] = source_thresholds.try_emplace(node.source_data);
+            if (is_new)
             {
-                pd->last_tool_begin = begin_time;
-                pd->last_tool_end = record_clock_t::now();
+                itr->second = get_threshold(node.function_source);
             }
-            else
+            if (itr->second.count() > 0)
             {
-                pd->last_tool_begin = {};
-                pd->last_tool_end = {};
-                auto &call_end_time = pd->get_function_data_stack(L).top().call_end_time;
-                call_end_time = record_clock_t::now();
+                slow_threshold = itr->second;
             }
-        });
-
-        // delay calculate tool time
-        if (auto &last_function_data_stack = pd->get_function_data_stack(pd->last_thread_of_hook); !last_function_data_stack.empty())
+        }
+        if (!is_pending && slow_threshold.count() > 0 && duration > slow_threshold)
         {
-            last_function_data_stack.top().children_tool_time += (pd->last_tool_end - pd->last_tool_begin);
+            // freezes after the return itself plus `after` events
+            is_pending = true;
+            pending = {&node, time, duration, flight_return};
+            pending_threshold = slow_threshold;
+            pending_after = after;
         }
+        record(node, time, duration, flight_return);
+    }
 
-        function_time_data_t parent = nullptr;
-        auto &function_data_stack = pd->get_function_data_stack(L, &function_name);
-        parent = function_data_stack.empty() ? pd->root : function_data_stack.top().node;
-        if (function_name.empty())
+    // only copies the ring events into a spare trace, names and formatting are left to the
+    // reader of the trace or to the writer thread
+    void freeze()
+    {
+        is_pending = false;
+        std::shared_ptr<flight_trace> trace;
+        if (spare_traces.empty())
         {
-            return;
+            trace = std::make_shared<flight_trace>(); // the dumps hold more than the spares
         }
         else
         {
-            function_time_data_t this_function_data = nullptr;
-            if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL)
-            {
-                auto itr = parent->children.find(function_name);
-                if (itr == parent->children.end())
-                {
-                    this_function_data = std::make_shared<function_time_data>();
-                    this_function_data->function_name = function_name;
-                    this_function_data->function_source = function_source;
-                    parent->children.insert({function_name, this_function_data});
-                }
-                else
-                {
-                    this_function_data = itr->second;
-                }
-            }
-
-            if (L != pd->last_thread_of_hook)
-            {
-                if (auto &last_coroutine_stack = pd->get_function_data_stack(pd->last_thread_of_hook); !last_coroutine_stack.empty())
-                {
-                    auto &top = last_coroutine_stack.top();
-                    top.new_thread_begin_time = begin_time;
-                }
-            }
-
-            if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL)
-            {
-                function_stack_node node;
-                node.function_name = function_name;
-                node.function_source = function_source;
-                node.call_begin_time = begin_time;
-                node.node = this_function_data;
-                node.is_tail_call = (event == LUA_HOOKTAILCALL);
-                this_function_data->count++;
-                function_data_stack.push(node);
-
-                return;
-            }
-            else
+            trace = std::move(spare_traces.back());
+            spare_traces.pop_back();
+        }
+        trace->index = ++trace_count;
+        trace->slow_call = pending;
+        trace->threshold = pending_threshold;
+        trace->tree = tree;
+        size_t first_event = (next_event + ring.size() - event_count) % ring.size();
+        size_t first_part = std::min(event_count, ring.size() - first_event);
+        trace->events.assign(ring.begin() + first_event, ring.begin() + first_event + first_part);
+        trace->events.insert(trace->events.end(), ring.begin(), ring.begin() + (event_count - first_part));
+        if (is_dump)
+        {
+            async_file_writer::shared().write(fmt::format("{}.lua_profile_slow_{}.txt", record_clock_t::now().time_since_epoch().count(), trace->index),
+                                              [trace]() { return format_flight_trace(*trace); });
+        }
+        traces.push_back(std::move(trace));
+        while (traces.size() > max_traces)
+        {
+            auto oldest = std::move(traces.front());
+            traces.pop_front();
+            if (oldest.use_count() == 1)
             {
-                if (L != pd->last_thread_of_hook)
-                {
-                    if (is_couroutine_dead(L, pd->last_thread_of_hook))
-                    {
-                        auto &last_function_data_stack = pd->get_function_data_stack(pd->last_thread_of_hook);
-                        bool is_tail_call_popped = false;
-                        while (!last_function_data_stack.empty())
-                        {
-                            calculate_time(last_function_data_stack, begin_time, is_tail_call_popped);
-                        }
-                    }
-
-                    if (auto &last_coroutine_stack = pd->get_function_data_stack(pd->last_thread_of_hook); !last_coroutine_stack.empty())
-                    {
-                        last_coroutine_stack.top().last_record_time = begin_time;
-                    }
-
-                    if (!function_data_stack.empty())
-                    {
-                        auto &top = function_data_stack.top();
-                        auto this_coroutine_time = (begin_time - top.call_end_time);
-                        auto trans_function_time = top.new_thread_begin_time - top.call_end_time;
-                        top.children_coroutine_time += (this_coroutine_time - trans_function_time);
-                        function_time_data_t coroutine_function_data = nullptr;
-                        std::string coroutine_function_name = pd->get_coroutine_name(pd->last_thread_of_hook);
-
-                        auto itr = top.node->children.find(coroutine_function_name);
-                        if (itr == top.node->children.end())
-                        {
-                            coroutine_function_data = std::make_shared<function_time_data>();
-                            coroutine_function_data->function_name = coroutine_function_name;
-                            top.node->children.insert({coroutine_function_name, coroutine_function_data});
-                        }
-                        else
-                        {
-                            coroutine_function_data = itr->second;
-                        }
-                        coroutine_function_data->count++;
-                    }
-                }
-                // for mismatch after error or return before yield
-                bool is_tail_call_popped = false;
-                while ((!function_data_stack.empty()) &&
-                       (function_data_stack.top().function_source != function_source))
-                {
-                    calculate_time(function_data_stack, begin_time, is_tail_call_popped);
-                }
-
-                if (function_data_stack.empty())
-                {
-                    return;
-                }
-                else
-                {
-                    assert(function_data_stack.top().function_source == function_source);
-                }
-
-                assert(is_tail_call_popped == false);
-                // for normal ret
-                calculate_time(function_data_stack, begin_time, is_tail_call_popped);
-                // for taill call
-                while ((!function_data_stack.empty()) && is_tail_call_popped)
-                {
-                    calculate_time(function_data_stack, begin_time, is_tail_call_popped);
-                }
+                // its dump is written, the fence orders the reads of the writer before the reuse
+                std::atomic_thread_fence(std::memory_order_acquire);
+                spare_traces.push_back(std::move(oldest));
             }
         }
     }
 };
 
-static void profile_hooker(lua_State *L, lua_Debug *ar)
+// start{adaptive = true}: samples the stack every sample_interval instructions to rank functions,
+// after sample_time only the top hot functions and their callers get call/return bookkeeping,
+// the hot set is ranked again every rerank from the samples taken meanwhile
+struct adaptive_profile
 {
-    auto_time t(L);
-    lua_getinfo(L, "Sn", ar);
-    t.event = ar->event;
-    bool is_c_function = (std::strcmp("C", ar->what) == 0);
-    if (is_c_function && (ar->name == nullptr))
+    enum function_state : uint8_t
     {
-        // a internal c function ?
-        return;
-    }
-    t.function_name = fmt::format("{}:{}:{}",
-                                  ar->name == nullptr ? "?" : ar->name,
-                                  ar->short_src,
-                                  ar->linedefined);
+        function_cold,
+        function_hot,
+        function_retiring, // was hot before the last rank, only its returns are accepted
+    };
 
-    if (is_c_function)
+    bool is_enabled = false;
+    bool is_precise = false;
+    size_t hot_count = 20;
+    int sample_interval = 1000;
+    time_unit_t sample_time = milliseconds(200);
+    time_unit_t rerank_time = milliseconds(2000);
+    lua_Hook precise_hook = nullptr;
+    time_point_t start_time = {};
+    time_point_t precise_begin_time = {}; // 0 until the precise phase of the current run
+    time_point_t stop_time = {};
+    time_point_t next_rank_time = {};
+    // samples since the last rank
+    std::unordered_map<const void *, uint64_t> self_samples;
+    std::unordered_map<const void *, std::unordered_set<const void *>> callers;
+    uint64_t window_sample_count = 0;
+    std::unordered_map<const void *, function_state> hot_functions;
+    const void *last_function = nullptr; // identity cache of the last checked function
+    function_state last_state = function_cold;
+    // cost and accuracy for report_info
+    uint64_t sample_count = 0;
+    uint64_t rank_count = 0;
+    uint64_t accepted_events = 0;
+    uint64_t rejected_events = 0;
+    time_unit_t sample_hook_time = {};
+    double coverage = 0; // share of the samples of the last window whose running function is hot
+
+    // by stop() and by a start without adaptive, report_info still shows the last run
+    void stop(const time_point_t &now)
     {
-        lua_getinfo(L, "f", ar);
-        t.function_source = fmt::format("c:{}",
-                                        lua_topointer(L, -1));
-        lua_pop(L, 1);
+        if (is_enabled)
+        {
+            stop_time = now;
+        }
+        is_enabled = false;
+        is_precise = false;
     }
-    else
+
+    bool accept(const void *function, int event)
     {
-        t.function_source = fmt::format("lua:{}:{}",
-                                        ar->short_src,
-                                        ar->linedefined);
+        if (function != last_function)
+        {
+            auto itr = hot_functions.find(function);
+            last_function = function;
+            last_state = itr == hot_functions.end() ? function_cold : itr->second;
+        }
+        bool is_accepted = last_state == function_hot || (last_state == function_retiring && event == LUA_HOOKRET);
+        ++(is_accepted ? accepted_events : rejected_events);
+        return is_accepted;
     }
-}
-
-static void print_tree(std::ostream &os, function_time_data_t &root, size_t max_name_length, size_t max_stack)
-{
 
-    traverse_tree<sort_t::total_time>(root, max_stack, [&](function_time_data_t &current, size_t current_stack) {
-        size_t intent_length = current_stack * per_indent_length;
-        std::string indent = current_stack == 0 ? "" : fmt::format(fmt::format("{{:{}}}", intent_length), "");
-        size_t intent_name_length = intent_length + current->function_name.length();
-        size_t align_length = max_name_length > intent_name_length ? (max_name_length - intent_name_length) : 2;
-        std::string align = fmt::format(fmt::format("{{:{}}}", align_length), "");
-
-        os << fmt::format("{}{}{} count:{:<10} total:{:<20} self:{:<16} children:{:<16}",
-                          indent,
-                          current->function_name,
-                          align,
-                          current->count,
-                          current->total_time.count(),
-                          current->self_time.count(),
-                          current->children_time.count())
-           << std::endl;
-    });
-}
+    void rank()
+    {
+        std::vector<std::pair<uint64_t, const void *>> ranked;
+        ranked.reserve(self_samples.size());
+        for (auto &&i : self_samples)
+        {
+            ranked.emplace_back(i.second, i.first);
+        }
+        size_t top = std::min(hot_count, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(), std::greater<>());
 
-static void print_list(std::ostream &os, function_time_data_t &root, size_t max_top)
-{
-    std::unordered_map<std::string, function_time_data> source_map;
-    size_t max_function_name_length = 0;
-    traverse_tree<sort_t::none>(root, 0, [&](function_time_data_t &current, size_t current_stack) {
-        if (current->function_source.empty())
+        // hot functions and everything seen calling them, so their stacks stay complete
+        std::unordered_set<const void *> new_hot_functions;
+        std::vector<const void *> pending;
+        uint64_t hot_sample_count = 0;
+        for (size_t i = 0; i < top; ++i)
         {
-            return;
+            hot_sample_count += ranked[i].first;
+            if (new_hot_functions.insert(ranked[i].second).second)
+            {
+                pending.push_back(ranked[i].second);
+            }
         }
-        auto itr = source_map.find(current->function_source);
-        if (itr == source_map.end())
+        while (!pending.empty())
         {
-            function_time_data data;
-            data.function_name = current->function_name;
-            data.function_source = current->function_source;
-            source_map.insert({current->function_source, data});
-            itr = source_map.find(current->function_source);
+            auto function = pending.back();
+            pending.pop_back();
+            if (auto itr = callers.find(function); itr != callers.end())
+            {
+                for (auto &&caller : itr->second)
+                {
+                    if (new_hot_functions.insert(caller).second)
+                    {
+                        pending.push_back(caller);
+                    }
+                }
+            }
         }
-        else
+
+        for (auto itr = hot_functions.begin(); itr != hot_functions.end();)
         {
-            auto &function_name = itr->second.function_name;
-            if (function_name != current->function_name && (function_name.find("?:") == 0))
+            if (new_hot_functions.count(itr->first) > 0 || itr->second == function_retiring)
+            {
+                itr = hot_functions.erase(itr);
+            }
+            else
             {
-                function_name = current->function_name; // for a better name;
+                itr->second = function_retiring;
+                ++itr;
             }
         }
-        auto &data = itr->second;
-        data.count += current->count;
-        data.self_time += current->self_time;
-        data.children_time += current->children_time;
-        data.total_time += (current->self_time + current->children_time);
-    });
-    std::vector<function_time_data *> sortable_data;
-    sortable_data.reserve(source_map.size());
+        for (auto &&function : new_hot_functions)
+        {
+            hot_functions[function] = function_hot;
+        }
+        last_function = nullptr;
 
-    for (auto &&i : source_map)
-    {
-        sortable_data.push_back(&i.second);
+        coverage = window_sample_count == 0 ? 0 : double(hot_sample_count) / window_sample_count;
+        self_samples.clear();
+        callers.clear();
+        window_sample_count = 0;
+        ++rank_count;
     }
-    std::sort(sortable_data.begin(), sortable_data.end(), [](function_time_data *l, function_time_data *r) {
-        return l->total_time > r->total_time;
-    });
+};
 
-    if (max_top > 0 && max_top < sortable_data.size())
-    {
-        sortable_data.resize(max_top);
-    }
+// profiler.live_export{...}: publishes the list and the top level of the tree to shared memory,
+// at most once per interval from the hook of the first event after it elapsed. totals only grow,
+// so the published tops are kept and merged with what returned since the last publish
+struct live_exporter
+{
+    bool is_enabled = false;
+    std::string name;
+    time_unit_t interval = milliseconds(500);
+    time_point_t next_publish_time = {};
+    shm_profile_layout *layout = nullptr;
+    std::unique_ptr<shm_profile_snapshot> snapshot;
+    std::vector<function_time_data *> touched_functions; // source data returned from since the last publish
+    std::vector<function_time_data *> touched_roots;     // top level nodes returned from since the last publish
+    std::vector<function_time_data *> top_functions;     // last published, by total time
+    std::vector<function_time_data *> top_roots;
+    std::unordered_set<const function_time_data *> touched; // what touched_functions and touched_roots hold
 
-    for (auto &&i : sortable_data)
+    void touch(function_time_data &node)
     {
-        max_function_name_length = std::max(max_function_name_length, i->function_name.length());
+        if (node.source_data != nullptr && touched.insert(node.source_data).second)
+        {
+            touched_functions.push_back(node.source_data);
+        }
+        if (node.parent != nullptr && node.parent->parent == nullptr && touched.insert(&node).second)
+        {
+            touched_roots.push_back(&node);
+        }
     }
 
-    for (auto &&i : sortable_data)
+    ~live_exporter()
     {
-        std::string function_name = fmt::format(fmt::format("{{:{}}}", max_function_name_length + space_after_name), i->function_name);
-        os << fmt::format("{} count:{:<10} total:{:<20} self:{:<16} children:{:<16}",
-                          function_name,
-                          i->count,
-                          i->total_time.count(),
-                          i->self_time.count(),
-                          i->children_time.count())
-           << std::endl;
+        close();
     }
-}
 
-static std::string children_key = "children";
+    bool open(const std::string &shm_name, std::string &error)
+    {
+        close();
+#if defined(_WIN32)
+        error = "live export needs posix shared memory";
+        return false;
+#else
+        int fd = shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0 && errno == EEXIST && is_stale(shm_name))
+        {
+            shm_unlink(shm_name.c_str());
+            fd = shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        }
+        if (fd < 0)
+        {
+            error = fmt::format("shm_open {} failed: {}", shm_name, std::strerror(errno));
+            return false;
+        }
+        bool is_sized = ftruncate(fd, sizeof(shm_profile_layout)) == 0;
+        void *address = is_sized ? mmap(nullptr, sizeof(shm_profile_layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (address == MAP_FAILED)
+        {
+            error = fmt::format("mapping {} failed: {}", shm_name, std::strerror(errno));
+            shm_unlink(shm_name.c_str());
+            return false;
+        }
+        layout = static_cast<shm_profile_layout *>(address);
+        layout->magic = shm_profile_magic;
+        layout->version = shm_profile_version;
+        layout->pid = getpid();
+        layout->sequence.store(0, std::memory_order_relaxed);
+        if (!snapshot)
+        {
+            snapshot = std::make_unique<shm_profile_snapshot>();
+        }
+        std::memset(snapshot.get(), 0, sizeof(shm_profile_snapshot));
+        shm_profile_write(*layout, *snapshot);
+        top_functions.reserve(shm_profile_max_functions);
+        top_roots.reserve(shm_profile_max_roots);
+        name = shm_name;
+        next_publish_time = {};
+        is_enabled = true;
+        return true;
+#endif
+    }
+
+    void close()
+    {
+#if !defined(_WIN32)
+        if (layout != nullptr)
+        {
+            munmap(layout, sizeof(shm_profile_layout));
+            shm_unlink(name.c_str());
+        }
+#endif
+        layout = nullptr;
+        is_enabled = false;
+        touched_functions.clear();
+        touched_roots.clear();
+        top_functions.clear();
+        top_roots.clear();
+        touched.clear();
+    }
+
+private:
+#if !defined(_WIN32)
+    // left behind by a lua profiler process which is gone, other segments are never taken over
+    static bool is_stale(const std::string &shm_name)
+    {
+        int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat status = {};
+        bool is_sized = fstat(fd, &status) == 0 && static_cast<size_t>(status.st_size) >= sizeof(shm_profile_layout);
+        void *address = is_sized ? mmap(nullptr, sizeof(shm_profile_layout), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (address == MAP_FAILED)
+        {
+            return false;
+        }
+        auto &existing = *static_cast<const shm_profile_layout *>(address);
+        bool is_stale_layout = existing.magic == shm_profile_magic && existing.pid > 0 &&
+                               kill(static_cast<pid_t>(existing.pid), 0) != 0 && errno == ESRCH;
+        munmap(address, sizeof(shm_profile_layout));
+        return is_stale_layout;
+    }
+#endif
+};
+
+// call graph mode, start{graph = true}: one entry per function and one per caller -> callee edge
+// instead of one node per call path, ids index functions and edges, root is function 0 and
+// calls the bottom of every stack. total times only count the outermost of the nested calls of a
+// function (and of an edge) on a stack so recursion is not counted twice, self times add up as usual
+struct call_graph
+{
+    static constexpr uint32_t root_id = 0;
+    static constexpr uint32_t no_id = UINT32_MAX;
+
+    struct function_entry
+    {
+        std::string function_name;
+        std::string function_source;
+        uint64_t count = 0;
+        time_unit_t self_time = {};
+        time_unit_t total_time = {};
+        std::vector<uint32_t> callee_edges;
+        std::vector<uint32_t> caller_edges;
+    };
+
+    struct edge_entry
+    {
+        uint32_t caller = root_id;
+        uint32_t callee = root_id;
+        uint64_t count = 0;
+        time_unit_t self_time = {}; // self time of callee when called by caller
+        time_unit_t total_time = {};
+    };
+
+    bool is_enabled = false;
+    std::vector<function_entry> functions = {new_root_entry()};
+    std::vector<edge_entry> edges;
+    std::unordered_map<std::string, uint32_t> function_ids; // by function_source
+    std::unordered_map<uint64_t, uint32_t> edge_ids;        // by caller << 32 | callee
+    std::unordered_map<const function_time_data *, uint32_t> node_ids; // function of a node, interned at its first call
+
+    static function_entry new_root_entry()
+    {
+        function_entry root;
+        root.function_name = "root";
+        return root;
+    }
+
+    uint32_t intern(const function_time_data &node)
+    {
+        auto [node_itr, is_new_node] = node_ids.try_emplace(&node, no_id);
+        if (is_new_node)
+        {
+            auto [itr, is_new] = function_ids.try_emplace(node.function_source, static_cast<uint32_t>(functions.size()));
+            if (is_new)
+            {
+                auto &function = functions.emplace_back();
+                function.function_name = node.source_data != nullptr ? node.source_data->function_name : node.function_name;
+                function.function_source = node.function_source;
+            }
+            node_itr->second = itr->second;
+        }
+        return node_itr->second;
+    }
+
+    // returns the edge to give back to on_return
+    uint32_t on_call(uint32_t caller, uint32_t callee)
+    {
+        auto [itr, is_new] = edge_ids.try_emplace(static_cast<uint64_t>(caller) << 32 | callee, static_cast<uint32_t>(edges.size()));
+        if (is_new)
+        {
+            auto &new_edge = edges.emplace_back();
+            new_edge.caller = caller;
+            new_edge.callee = callee;
+            functions[caller].callee_edges.push_back(itr->second);
+            functions[callee].caller_edges.push_back(itr->second);
+        }
+        ++edges[itr->second].count;
+        ++functions[callee].count;
+        return itr->second;
+    }
+
+    // is_outermost_function/edge: no call of the function/edge below on the same stack
+    void on_return(uint32_t edge_id, time_unit_t self_time, time_unit_t total_time, bool is_outermost_function, bool is_outermost_edge)
+    {
+        auto &edge = edges[edge_id];
+        auto &function = functions[edge.callee];
+        edge.self_time += self_time;
+        function.self_time += self_time;
+        if (is_outermost_edge)
+        {
+            edge.total_time += total_time;
+        }
+        if (is_outermost_function)
+        {
+            function.total_time += total_time;
+        }
+    }
+
+    // function_source, "file.lua:12" or a name as reported
+    uint32_t find(const std::string &source, const std::string &name) const
+    {
+        if (auto itr = function_ids.find(source); itr != function_ids.end())
+        {
+            return itr->second;
+        }
+        auto itr = std::find_if(functions.begin(), functions.end(), [&](const function_entry &function) { return function.function_name == name; });
+        return itr == functions.end() ? no_id : static_cast<uint32_t>(itr - functions.begin());
+    }
+};
+
+struct function_stack_node
+{
+    std::string function_source = "";
+    time_point_t call_begin_time = {};
+    time_point_t call_end_time = {};
+    time_point_t last_record_time = {};
+    time_point_t new_thread_begin_time = {};
+    time_unit_t children_tool_time = {};
+    time_unit_t children_pure_time = {};
+    time_unit_t children_coroutine_time = {};
+    function_time_data *node = nullptr; // owned by the tree
+    uint32_t graph_function = call_graph::root_id;
+    uint32_t graph_edge = call_graph::no_id;
+    bool is_graph_outermost_function = false;
+    bool is_graph_outermost_edge = false;
+    bool is_tail_call = false;
+};
+
+// thread cpu clock or hardware counter counterparts of the times of function_stack_node
+template <typename point_t, typename span_t>
+struct function_stack_values
+{
+    point_t call_begin = {};
+    point_t call_end = {};
+    point_t last_record = {};
+    point_t new_thread_begin = {};
+    span_t children_tool = {};
+    span_t children_pure = {};
+    span_t children_coroutine = {};
+};
+
+using function_stack_cpu_time = function_stack_values<time_point_t, time_unit_t>;
+using function_stack_perf_counters = function_stack_values<perf_counter_values, perf_counter_values>;
+
+// the top of the stack is back(), the values of start{cpu_time = true} and start{perf_counters = true}
+// are in stacks of their own which only the hooks recording them fill up to the nodes when they read
+// them, pops keep them no longer than the nodes
+struct function_stack_t
+{
+    std::vector<function_stack_node> nodes;
+    std::vector<function_stack_cpu_time> cpu_times;
+    std::vector<function_stack_perf_counters> perf_counters;
+
+    bool empty() const
+    {
+        return nodes.empty();
+    }
+
+    size_t size() const
+    {
+        return nodes.size();
+    }
+
+    std::vector<function_stack_node>::const_iterator begin() const
+    {
+        return nodes.begin();
+    }
+
+    std::vector<function_stack_node>::const_iterator end() const
+    {
+        return nodes.end();
+    }
+
+    function_stack_node &back()
+    {
+        return nodes.back();
+    }
+
+    function_stack_cpu_time &cpu_time_back()
+    {
+        if (cpu_times.size() < nodes.size())
+        {
+            cpu_times.resize(nodes.size());
+        }
+        return cpu_times.back();
+    }
+
+    function_stack_perf_counters &perf_counters_back()
+    {
+        if (perf_counters.size() < nodes.size())
+        {
+            perf_counters.resize(nodes.size());
+        }
+        return perf_counters.back();
+    }
+
+    // calls of each graph function and edge on this stack, the outermost one found none
+    std::unordered_map<uint32_t, uint32_t> graph_function_depths;
+    std::unordered_map<uint32_t, uint32_t> graph_edge_depths;
+
+    function_stack_node &push_back()
+    {
+        return nodes.emplace_back();
+    }
+
+    void pop_back()
+    {
+        if (auto &top = nodes.back(); top.graph_edge != call_graph::no_id)
+        {
+            leave_graph(graph_function_depths, top.graph_function);
+            leave_graph(graph_edge_depths, top.graph_edge);
+        }
+        nodes.pop_back();
+        if (cpu_times.size() > nodes.size())
+        {
+            cpu_times.pop_back();
+        }
+        if (perf_counters.size() > nodes.size())
+        {
+            perf_counters.pop_back();
+        }
+    }
+
+private:
+    static void leave_graph(std::unordered_map<uint32_t, uint32_t> &depths, uint32_t id)
+    {
+        auto itr = depths.find(id);
+        if (--itr->second == 0)
+        {
+            depths.erase(itr);
+        }
+    }
+};
+
+// source_data is the identity of a function, shared by all its nodes
+static bool stack_contains(const function_stack_t &stack, const function_time_data *source_data)
+{
+    return std::any_of(stack.begin(), stack.end(), [&](const function_stack_node &node) { return node.node->source_data == source_data; });
+}
+
+// how a returned call adds to its node: in graph mode the node is the function, only its
+// outermost call on the stack adds to total, children is then what total has above self
+enum class call_totals : uint8_t
+{
+    added,
+    outermost,
+    nested,
+};
+
+template <typename value_t>
+static void add_call(value_t &self, value_t &children, value_t &total, const value_t &call_self, const value_t &call_children, const value_t &call_total, call_totals totals)
+{
+    self += call_self;
+    if (totals == call_totals::added)
+    {
+        children += call_children;
+        total += call_total;
+    }
+    else if (totals == call_totals::outermost)
+    {
+        total += call_total;
+        children = total - self;
+    }
+}
+
+// the cpu clock and hardware counter arithmetic is only compiled for hooks recording them
+template <bool is_cpu_time, bool is_perf_counters>
+static void calculate_time(function_stack_t &data_stack, frame_recorder &frames, flight_recorder &flight, call_graph &graph, live_exporter &live, const time_point_t &begin_time, const time_point_t &cpu_begin_time, const perf_counter_values &perf_begin, bool &is_tail_call_popped)
+{
+    auto &current_top = data_stack.back();
+    auto &node = *current_top.node;
+    if (frames.is_enabled)
+    {
+        frames.touch(node);
+    }
+    // this_all = this_tool_time + children + children_tool_time + self
+    // this_sub = children_tooltime + self + children
+    auto tool_total_time = current_top.call_end_time - current_top.call_begin_time + current_top.children_tool_time;
+    auto coroutine_time = current_top.children_coroutine_time;
+    auto sub_time = begin_time - current_top.call_end_time;
+    auto pure_sub_time = sub_time - current_top.children_tool_time - coroutine_time;
+    auto self_time = pure_sub_time - current_top.children_pure_time;
+    auto totals = current_top.graph_edge == call_graph::no_id ? call_totals::added
+                  : current_top.is_graph_outermost_function   ? call_totals::outermost
+                                                              : call_totals::nested;
+    add_call(node.self_time, node.children_time, node.total_time, self_time, current_top.children_pure_time, pure_sub_time, totals);
+    if (node.source_data != nullptr)
+    {
+        add_call(node.source_data->self_time, node.source_data->children_time, node.source_data->total_time, self_time, current_top.children_pure_time, pure_sub_time, totals);
+    }
+    // the same on thread cpu clock
+    time_unit_t cpu_tool_total_time = {};
+    time_unit_t cpu_coroutine_time = {};
+    time_unit_t cpu_pure_sub_time = {};
+    if constexpr (is_cpu_time)
+    {
+        auto &cpu_top = data_stack.cpu_time_back();
+        cpu_tool_total_time = cpu_top.call_end - cpu_top.call_begin + cpu_top.children_tool;
+        cpu_coroutine_time = cpu_top.children_coroutine;
+        auto cpu_sub_time = cpu_begin_time - cpu_top.call_end;
+        cpu_pure_sub_time = cpu_sub_time - cpu_top.children_tool - cpu_coroutine_time;
+        auto cpu_self_time = cpu_pure_sub_time - cpu_top.children_pure;
+        auto &cpu = node.record_cpu_time();
+        add_call(cpu.self_time, cpu.children_time, cpu.total_time, cpu_self_time, cpu_top.children_pure, cpu_pure_sub_time, totals);
+        if (node.source_data != nullptr)
+        {
+            auto &source_cpu = node.source_data->record_cpu_time();
+            add_call(source_cpu.self_time, source_cpu.children_time, source_cpu.total_time, cpu_self_time, cpu_top.children_pure, cpu_pure_sub_time, totals);
+        }
+    }
+    // and on hardware counters
+    perf_counter_values perf_tool_total;
+    perf_counter_values perf_coroutine;
+    perf_counter_values perf_pure_sub;
+    if constexpr (is_perf_counters)
+    {
+        auto &perf_top = data_stack.perf_counters_back();
+        perf_tool_total = perf_top.call_end - perf_top.call_begin + perf_top.children_tool;
+        perf_coroutine = perf_top.children_coroutine;
+        perf_pure_sub = perf_begin - perf_top.call_end - perf_top.children_tool - perf_coroutine;
+        auto perf_self = perf_pure_sub - perf_top.children_pure;
+        auto &perf = node.record_perf_counters();
+        add_call(perf.self, perf.children, perf.total, perf_self, perf_top.children_pure, perf_pure_sub, totals);
+        if (node.source_data != nullptr)
+        {
+            auto &source_perf = node.source_data->record_perf_counters();
+            add_call(source_perf.self, source_perf.children, source_perf.total, perf_self, perf_top.children_pure, perf_pure_sub, totals);
+        }
+    }
+    if (flight.is_enabled)
+    {
+        flight.on_return(node, begin_time, pure_sub_time);
+    }
+    if (live.is_enabled)
+    {
+        live.touch(node);
+    }
+    if (current_top.graph_edge != call_graph::no_id)
+    {
+        graph.on_return(current_top.graph_edge, self_time, pure_sub_time, current_top.is_graph_outermost_function, current_top.is_graph_outermost_edge);
+    }
+    is_tail_call_popped = current_top.is_tail_call;
+    data_stack.pop_back();
+    if (!data_stack.empty())
+    {
+        auto &top = data_stack.back();
+        top.children_tool_time += tool_total_time;
+        top.children_pure_time += pure_sub_time;
+        top.children_coroutine_time += coroutine_time;
+        if constexpr (is_cpu_time)
+        {
+            auto &cpu_top = data_stack.cpu_time_back();
+            cpu_top.children_tool += cpu_tool_total_time;
+            cpu_top.children_pure += cpu_pure_sub_time;
+            cpu_top.children_coroutine += cpu_coroutine_time;
+        }
+        if constexpr (is_perf_counters)
+        {
+            auto &perf_top = data_stack.perf_counters_back();
+            perf_top.children_tool += perf_tool_total;
+            perf_top.children_pure += perf_pure_sub;
+            perf_top.children_coroutine += perf_coroutine;
+        }
+    }
+    else if (node.parent != nullptr)
+    {
+        // the bottom of a stack hangs on root which has no stack node of its own
+        node.parent->children_time += pure_sub_time;
+        node.parent->total_time += pure_sub_time;
+        if constexpr (is_cpu_time)
+        {
+            auto &parent_cpu = node.parent->record_cpu_time();
+            parent_cpu.children_time += cpu_pure_sub_time;
+            parent_cpu.total_time += cpu_pure_sub_time;
+        }
+        if constexpr (is_perf_counters)
+        {
+            auto &parent_perf = node.parent->record_perf_counters();
+            parent_perf.children += perf_pure_sub;
+            parent_perf.total += perf_pure_sub;
+        }
+    }
+}
+
+static const char *profile_data_metatable_name = "profile_data_metatable";
+static const char *coroutine_stack_metatable_name = "coroutine_stack_metatable";
+static const char *weak_table_metatable_name = "profile_data_weak_table_metatable";
+
+// the node of a coroutine under the function resuming it, reused while the resumer stays the same
+struct coroutine_switch_cache
+{
+    function_time_data *resumer_node = nullptr;
+    function_time_data *coroutine_node = nullptr;
+};
+
+struct coroutine_stack_userdata
+{
+    function_stack_t coroutine_stack;
+    std::string coroutine_name;
+    std::weak_ptr<struct profile_data> pd;
+    lua_State *thread = nullptr;
+    coroutine_switch_cache switch_cache;
+    bool is_resume_status_known = false; // set by the coroutine.resume/wrap replacements, cleared at the switch
+    bool is_dead = false;
+};
+
+static int coroutine_stack_userdata_gc(lua_State *L);
+
+// optional columns of the reports, following what the profile was started with
+struct report_columns
+{
+    bool cpu_time = false;
+    bool perf_counters = false;
+};
+
+// values of a query entry when a page first showed it, so it shows the same on every page
+struct query_values
+{
+    uint64_t count = 0;
+    time_unit_t total_time = {};
+    time_unit_t self_time = {};
+    time_unit_t children_time = {};
+    time_unit_t cpu_total_time = {};
+    time_unit_t cpu_self_time = {};
+    perf_counter_values perf_total;
+    perf_counter_values perf_self;
+    size_t child_count = 0;
+
+    explicit query_values(const function_time_data &node)
+        : count(node.count), total_time(node.total_time), self_time(node.self_time), children_time(node.children_time),
+          cpu_total_time(node.get_cpu_time().total_time), cpu_self_time(node.get_cpu_time().self_time),
+          perf_total(node.get_perf_counters().total), perf_self(node.get_perf_counters().self),
+          child_count(node.children.size())
+    {
+    }
+};
+
+// a node matched by the query snapshot and its sort key when the snapshot was taken
+struct query_entry
+{
+    static constexpr size_t no_values = SIZE_MAX;
+
+    const function_time_data *data = nullptr;
+    int64_t sort_key = 0;
+    size_t values = no_values; // index in profile_data::query_entry_values once a page showed it
+};
+
+struct profile_data : std::enable_shared_from_this<profile_data>
+{
+    function_time_data_t root = std::make_shared<function_time_data>();
+    function_stack_t main_thread_stack;
+    lua_State *last_thread_of_hook = nullptr;
+    coroutine_stack_userdata *last_coroutine_of_hook = nullptr; // of last_thread_of_hook, nullptr for main thread
+    lua_State *main_thread = nullptr;
+    time_point_t last_tool_begin = {};
+    time_point_t last_tool_end = {};
+    time_point_t cpu_last_tool_begin = {};
+    time_point_t cpu_last_tool_end = {};
+    bool is_cpu_time = false; // started with cpu_time at least once, reports add cpu columns
+    perf_counter_values perf_last_tool_begin;
+    perf_counter_values perf_last_tool_end;
+    bool is_perf_counters = false; // started with perf_counters at least once, reports add counter columns
+    std::string perf_counters_error; // why start{perf_counters = true} went on without counters
+    frame_recorder frames;
+    flight_recorder flight;
+    live_exporter live;
+    call_graph graph;
+    std::unordered_map<std::string, function_time_data> source_map;
+    std::vector<size_t> max_name_length_of_stack = {root->function_name.length()};
+    size_t node_count = 1;
+    uint64_t generation = 1; // bumped whenever times are accumulated, calls alone only change counts
+    std::vector<function_time_data *> sorted_source_data;
+    uint64_t sorted_source_data_generation = 0;
+    // threads of the last resume, its yield switches back between the same two, alive until their
+    // userdata is collected, see get_function_data_stack
+    std::array<std::pair<lua_State *, coroutine_stack_userdata *>, 2> found_coroutines = {};
+    coroutine_switch_cache main_thread_switch_cache;
+    lua_Hook hook = nullptr;             // set by start, given to attached and targeted coroutines
+    int hook_mask = 0;
+    int hook_count = 0;
+    bool is_coarse_clock = false; // clock of the recorded times, the other clock needs a clear() first
+    adaptive_profile adaptive;
+    bool is_coroutine_targeted = false;  // start{coroutines = ...}, other new coroutines run without hook
+    std::unordered_set<const void *> coroutine_target_functions; // anchored at coroutine_targets_key() so addresses stay theirs
+    // snapshot of the entries matched by the last profiler.query, kept for its next pages until refresh
+    std::string query_key;
+    std::vector<query_entry> query_entries;
+    std::vector<query_values> query_entry_values;
+    size_t query_sorted_count = 0;
+
+    void set_thread_hook(lua_State *co) const
+    {
+        lua_sethook(co, hook, hook_mask, hook_count);
+    }
+
+    bool is_main_thread(lua_State *L) const
+    {
+        return main_thread == L;
+    }
+
+    std::string get_coroutine_name(lua_State *co, const coroutine_stack_userdata *ud) const
+    {
+        if (is_main_thread(co))
+        {
+            return "mainthread";
+        }
+        if (ud != nullptr && !ud->coroutine_name.empty())
+        {
+            return ud->coroutine_name;
+        }
+        return "coroutine:[?]";
+    }
+
+    void remember_coroutine(lua_State *co, coroutine_stack_userdata *ud)
+    {
+        if (found_coroutines[0].first != co)
+        {
+            found_coroutines[1] = found_coroutines[0];
+            found_coroutines[0] = {co, ud};
+        }
+    }
+
+    // the running thread L
+    coroutine_stack_userdata *find_coroutine(lua_State *L)
+    {
+        for (auto &&found : found_coroutines)
+        {
+            if (found.first == L)
+            {
+                return found.second;
+            }
+        }
+        if (is_main_thread(L) || !lua_checkstack(L, 2))
+        {
+            return nullptr;
+        }
+        lua_rawgetp(L, LUA_REGISTRYINDEX, reg_key());
+        lua_pushthread(L);
+        auto ud = find_coroutine(L, -1, -2);
+        lua_pop(L, 2);
+        return ud;
+    }
+
+    // the thread at thread_index of the running L, looked up on the stack of L in the weak table of the
+    // profile_data userdata at pd_index, a thread which is not running must not have its stack touched
+    coroutine_stack_userdata *find_coroutine(lua_State *L, int thread_index, int pd_index)
+    {
+        auto co = lua_tothread(L, thread_index);
+        for (auto &&found : found_coroutines)
+        {
+            if (found.first == co)
+            {
+                return found.second;
+            }
+        }
+        if (is_main_thread(co))
+        {
+            return nullptr;
+        }
+        thread_index = lua_absindex(L, thread_index);
+        lua_getuservalue(L, pd_index);
+        lua_pushvalue(L, thread_index);
+        lua_rawget(L, -2);
+        auto ud = static_cast<coroutine_stack_userdata *>(lua_touserdata(L, -1)); // nullptr for hooked threads not run yet
+        lua_pop(L, 2);
+        if (ud != nullptr)
+        {
+            remember_coroutine(co, ud);
+        }
+        return ud;
+    }
+
+    // stack of last_thread_of_hook, which is not running so it is not looked up
+    function_stack_t &get_last_thread_stack()
+    {
+        if (last_coroutine_of_hook != nullptr)
+        {
+            return last_coroutine_of_hook->coroutine_stack;
+        }
+        if (is_main_thread(last_thread_of_hook))
+        {
+            return main_thread_stack;
+        }
+        static function_stack_t dummy;
+        return dummy;
+    }
+
+    void on_coroutine_collected(coroutine_stack_userdata *ud)
+    {
+        for (auto &&found : found_coroutines)
+        {
+            if (found.second == ud)
+            {
+                found = {};
+            }
+        }
+        if (last_thread_of_hook == ud->thread)
+        {
+            last_thread_of_hook = main_thread;
+            last_coroutine_of_hook = nullptr;
+        }
+    }
+
+    function_time_data_t new_child(function_time_data &parent, const std::string &function_name, const std::string &function_source)
+    {
+        auto child = std::make_shared<function_time_data>();
+        child->function_name = function_name;
+        child->function_source = function_source;
+        child->parent = &parent;
+        child->stack_depth = parent.stack_depth + 1;
+        parent.children.insert({function_name, child});
+        ++node_count;
+
+        if (max_name_length_of_stack.size() <= child->stack_depth)
+        {
+            max_name_length_of_stack.resize(child->stack_depth + 1, 0);
+        }
+        auto &max_name_length = max_name_length_of_stack[child->stack_depth];
+        max_name_length = std::max(max_name_length, function_name.length() + child->stack_depth * per_indent_length);
+
+        if (!function_source.empty())
+        {
+            auto itr = source_map.find(function_source);
+            if (itr == source_map.end())
+            {
+                function_time_data data;
+                data.function_name = function_name;
+                data.function_source = function_source;
+                itr = source_map.insert({function_source, std::move(data)}).first;
+            }
+            else
+            {
+                auto &source_function_name = itr->second.function_name;
+                if (source_function_name != function_name && (source_function_name.find("?:") == 0))
+                {
+                    source_function_name = function_name; // for a better name;
+                }
+            }
+            child->source_data = &itr->second;
+        }
+        return child;
+    }
+
+    // sorted by total time descending, new functions rebuild it, changed times re-sort it only when
+    // they broke the order of the last report
+    const std::vector<function_time_data *> &get_sorted_source_data(size_t thread_count)
+    {
+        auto by_total_time = [](function_time_data *l, function_time_data *r) {
+            if (l->total_time != r->total_time)
+            {
+                return l->total_time > r->total_time;
+            }
+            return l->function_source < r->function_source;
+        };
+        if (sorted_source_data.size() != source_map.size())
+        {
+            sorted_source_data.clear();
+            sorted_source_data.reserve(source_map.size());
+            for (auto &&i : source_map)
+            {
+                sorted_source_data.push_back(&i.second);
+            }
+            parallel_sort(sorted_source_data.begin(), sorted_source_data.end(), thread_count, by_total_time);
+        }
+        else if (sorted_source_data_generation != generation && !std::is_sorted(sorted_source_data.begin(), sorted_source_data.end(), by_total_time))
+        {
+            parallel_sort(sorted_source_data.begin(), sorted_source_data.end(), thread_count, by_total_time);
+        }
+        sorted_source_data_generation = generation;
+        return sorted_source_data;
+    }
+
+    function_stack_t &get_function_data_stack(lua_State *L, std::string *name = nullptr)
+    {
+        if (is_main_thread(L))
+        {
+            return main_thread_stack;
+        }
+        if (auto ud = find_coroutine(L); ud != nullptr)
+        {
+            return ud->coroutine_stack;
+        }
+        if (name == nullptr)
+        {
+            static function_stack_t dummy;
+            return dummy;
+        }
+
+        // first event of the coroutine, bind a stack to the thread in the weak table so it is released with it,
+        // the userdata keeps the thread as its user value: a collected thread is then only freed after the
+        // __gc of its userdata, so no new thread reuses its address while a raw pointer to it is kept
+        auto top = lua_gettop(L);
+        scope_on_exit _([L, top]() {
+            lua_settop(L, top);
+        });
+        lua_rawgetp(L, LUA_REGISTRYINDEX, reg_key());
+        lua_getuservalue(L, -1);
+        lua_pushthread(L);
+        auto ud = new (lua_newuserdata(L, sizeof(coroutine_stack_userdata))) coroutine_stack_userdata();
+        ud->coroutine_name = fmt::format("coroutine:{}", *name);
+        ud->pd = weak_from_this();
+        ud->thread = L;
+
+        if (luaL_newmetatable(L, coroutine_stack_metatable_name))
+        {
+            lua_pushstring(L, "__gc");
+            lua_pushcfunction(L, coroutine_stack_userdata_gc);
+            lua_rawset(L, -3);
+        }
+        lua_setmetatable(L, -2);
+        lua_pushthread(L);
+        lua_setuservalue(L, -2);
+        assert(lua_istable(L, -3));
+        assert(lua_isthread(L, -2));
+        assert(lua_isuserdata(L, -1));
+        lua_rawset(L, -3);
+        remember_coroutine(L, ud);
+        return ud->coroutine_stack;
+    }
+
+    static const void *reg_key()
+    {
+        static char c;
+        return &c;
+    }
+
+    // function -> true, keeps the functions of coroutine_target_functions alive
+    static const void *coroutine_targets_key()
+    {
+        static char c;
+        return &c;
+    }
+
+    // node -> name string, so the pages of a query snapshot push the same lua string for a node
+    static const void *name_cache_key()
+    {
+        static char c;
+        return &c;
+    }
+
+    report_columns get_report_columns() const
+    {
+        return {is_cpu_time, is_perf_counters};
+    }
+
+    size_t get_max_function_name_length(size_t max_stack) const
+    {
+        // traverse_tree visits at most max_stack + 1 levels below root
+        size_t stack_limit = max_stack > 0 ? std::min(max_stack + 2, max_name_length_of_stack.size()) : max_name_length_of_stack.size();
+        size_t max_function_name_length = 0;
+        for (size_t i = 0; i < stack_limit; ++i)
+        {
+            max_function_name_length = std::max(max_function_name_length, max_name_length_of_stack[i]);
+        }
+        return max_function_name_length;
+    }
+};
+
+struct profile_data_userdata
+{
+    std::shared_ptr<profile_data> pd = nullptr;
+};
+
+static int profile_data_gc(lua_State *L)
+{
+    auto pdptr = static_cast<profile_data_userdata *>(lua_touserdata(L, -1));
+    pdptr->pd = nullptr;
+    return 0;
+}
+
+// pops every call of a stack outside the hook, with the columns the profile records
+static void close_function_stack(profile_data &pd, function_stack_t &stack, const time_point_t &begin_time, const time_point_t &cpu_begin_time, const perf_counter_values &perf_begin)
+{
+    auto close = [&](auto is_cpu_time, auto is_perf_counters) {
+        bool is_tail_call_popped = false;
+        while (!stack.empty())
+        {
+            calculate_time<decltype(is_cpu_time)::value, decltype(is_perf_counters)::value>(stack, pd.frames, pd.flight, pd.graph, pd.live, begin_time, cpu_begin_time, perf_begin, is_tail_call_popped);
+        }
+    };
+    if (pd.is_cpu_time)
+    {
+        pd.is_perf_counters ? close(std::true_type(), std::true_type()) : close(std::true_type(), std::false_type());
+    }
+    else
+    {
+        pd.is_perf_counters ? close(std::false_type(), std::true_type()) : close(std::false_type(), std::false_type());
+    }
+}
+
+static int coroutine_stack_userdata_gc(lua_State *L)
+{
+    auto ud = static_cast<coroutine_stack_userdata *>(luaL_checkudata(L, -1, coroutine_stack_metatable_name));
+    if (auto pd = ud->pd.lock(); pd != nullptr)
+    {
+        ++pd->generation;
+        auto &coroutine_stack = ud->coroutine_stack;
+
+        time_point_t begin_time = {};
+        time_point_t cpu_begin_time = {};
+        perf_counter_values perf_begin;
+        if (!coroutine_stack.empty())
+        {
+            begin_time = coroutine_stack.back().last_record_time;
+            if (pd->is_cpu_time)
+            {
+                cpu_begin_time = coroutine_stack.cpu_time_back().last_record;
+            }
+            if (pd->is_perf_counters)
+            {
+                perf_begin = coroutine_stack.perf_counters_back().last_record;
+            }
+        }
+
+        close_function_stack(*pd, coroutine_stack, begin_time, cpu_begin_time, perf_begin);
+        pd->on_coroutine_collected(ud);
+    }
+    ud->~coroutine_stack_userdata();
+
+    return 0;
+}
+
+static void Log(lua_State *L, std::string &str)
+{
+    lua_getglobal(L, "log");
+    lua_pushstring(L, str.c_str());
+    lua_call(L, 1, 0);
+}
+
+static std::shared_ptr<profile_data> get_or_new_pd_from_lua(lua_State *L)
+{
+    auto top = lua_gettop(L);
+    std::shared_ptr<profile_data> pd;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        auto dataptr = new (lua_newuserdata(L, sizeof(profile_data_userdata))) profile_data_userdata();
+        pd = std::make_shared<profile_data>();
+        dataptr->pd = pd;
+        if (luaL_newmetatable(L, profile_data_metatable_name))
+        {
+            lua_pushcfunction(L, profile_data_gc);
+            lua_setfield(L, -2, "__gc");
+        }
+        lua_setmetatable(L, -2);
+        lua_newtable(L); // uservalue for coroutine stack map
+        if (luaL_newmetatable(L, weak_table_metatable_name))
+        {
+            lua_pushstring(L, "__mode");
+            lua_pushstring(L, "k");
+            lua_rawset(L, -3);
+        }
+        lua_setmetatable(L, -2);
+        lua_setuservalue(L, -2);
+
+        lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+        pd->last_thread_of_hook = L;
+        pd->main_thread = get_main_thread(L);
+    }
+    else
+    {
+        auto dataptr = (profile_data_userdata *)lua_touserdata(L, -1);
+        pd = dataptr->pd;
+        lua_pop(L, 1);
+    }
+    assert(lua_gettop(L) == top);
+    return pd;
+}
+
+static void fill_shm_entry(shm_profile_entry &entry, const function_time_data &data)
+{
+    auto name_length = std::min(data.function_name.length(), shm_profile_name_length - 1);
+    std::memcpy(entry.function_name, data.function_name.data(), name_length);
+    entry.function_name[name_length] = '\0';
+    entry.count = data.count;
+    entry.total_time = data.total_time.count();
+    entry.self_time = data.self_time.count();
+    entry.children_time = data.children_time.count();
+    auto &cpu = data.get_cpu_time();
+    auto &perf = data.get_perf_counters();
+    entry.cpu_total_time = cpu.total_time.count();
+    entry.cpu_self_time = cpu.self_time.count();
+    std::copy(perf.total.values.begin(), perf.total.values.end(), entry.perf_total);
+    std::copy(perf.self.values.begin(), perf.self.values.end(), entry.perf_self);
+}
+
+// merges the last published top with the data touched since, untouched data kept its totals
+// so it can not overtake the top, the cost follows the top size and the calls since the last publish
+template <typename compare_t>
+static void merge_live_top(std::vector<function_time_data *> &top, std::vector<function_time_data *> &touched, const std::unordered_set<const function_time_data *> &touched_set, size_t max_size, compare_t compare)
+{
+    for (auto &&data : top)
+    {
+        if (touched_set.count(data) == 0)
+        {
+            touched.push_back(data);
+        }
+    }
+    size_t top_size = std::min(touched.size(), max_size);
+    std::partial_sort(touched.begin(), touched.begin() + top_size, touched.end(), compare);
+    top.assign(touched.begin(), touched.begin() + top_size);
+    touched.clear();
+}
+
+static void publish_live_export(profile_data &pd, const time_point_t &now)
+{
+    auto &live = pd.live;
+    auto &snapshot = *live.snapshot;
+    auto by_total_time = [](function_time_data *l, function_time_data *r) {
+        if (l->total_time != r->total_time)
+        {
+            return l->total_time > r->total_time;
+        }
+        return l->function_source < r->function_source;
+    };
+    live.next_publish_time = now + live.interval;
+
+    merge_live_top(live.top_functions, live.touched_functions, live.touched, shm_profile_max_functions, by_total_time);
+    merge_live_top(live.top_roots, live.touched_roots, live.touched, shm_profile_max_roots, by_total_time);
+    live.touched.clear();
+    size_t function_count = live.top_functions.size();
+    for (size_t i = 0; i < function_count; ++i)
+    {
+        fill_shm_entry(snapshot.functions[i], *live.top_functions[i]);
+    }
+    size_t root_count = live.top_roots.size();
+    for (size_t i = 0; i < root_count; ++i)
+    {
+        fill_shm_entry(snapshot.roots[i], *live.top_roots[i]);
+    }
+
+    ++snapshot.publish_count;
+    snapshot.publish_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+    snapshot.root_total_time = pd.root->total_time.count();
+    snapshot.function_count = static_cast<uint32_t>(function_count);
+    snapshot.root_count = static_cast<uint32_t>(root_count);
+    snapshot.columns = (pd.is_cpu_time ? shm_profile_cpu_time : 0) | (pd.is_perf_counters ? shm_profile_perf_counters : 0);
+    shm_profile_write(*live.layout, snapshot);
+}
+
+// nullptr before the first use of the profiler, never creates the data
+static profile_data *find_pd_from_lua(lua_State *L)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+    auto dataptr = static_cast<profile_data_userdata *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return dataptr == nullptr ? nullptr : dataptr->pd.get();
+}
+
+// one stack sample for the adaptive ranking, ranks when it is time and moves to the precise phase
+static void adaptive_sample(lua_State *L, profile_data &pd)
+{
+    auto &adaptive = pd.adaptive;
+    auto begin_time = record_clock_t::now();
+    lua_Debug ar;
+    const void *callee = nullptr;
+    for (int level = 0; level < 64 && lua_getstack(L, level, &ar); ++level)
+    {
+        lua_getinfo(L, "f", &ar);
+        auto function = lua_topointer(L, -1);
+        lua_pop(L, 1);
+        if (callee == nullptr)
+        {
+            ++adaptive.self_samples[function];
+        }
+        else
+        {
+            adaptive.callers[callee].insert(function);
+        }
+        callee = function;
+    }
+    ++adaptive.sample_count;
+    ++adaptive.window_sample_count;
+
+    if (begin_time >= adaptive.next_rank_time)
+    {
+        adaptive.rank();
+        adaptive.next_rank_time = begin_time + adaptive.rerank_time;
+        if (!adaptive.is_precise)
+        {
+            adaptive.is_precise = true;
+            adaptive.precise_begin_time = begin_time;
+            pd.hook = adaptive.precise_hook;
+            pd.hook_mask = LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT;
+        }
+    }
+    adaptive.sample_hook_time += record_clock_t::now() - begin_time;
+}
+
+// sampling phase of start{adaptive = true}
+static void adaptive_sample_hooker(lua_State *L, lua_Debug * /*ar*/)
+{
+    auto pd = find_pd_from_lua(L);
+    if (pd == nullptr || pd->hook == nullptr)
+    {
+        lua_sethook(L, nullptr, 0, 0); // stopped, a thread stop did not see
+        return;
+    }
+    adaptive_sample(L, *pd);
+    if (pd->hook != adaptive_sample_hooker)
+    {
+        pd->set_thread_hook(L); // precise phase started, here or in another thread
+    }
+}
+
+// precise phase: calls and returns of functions that are not hot are dropped, the function
+// identity is all the check reads, pd is the one the hook already looked up
+static bool accept_adaptive_event(lua_State *L, lua_Debug *ar, profile_data &pd)
+{
+    if (pd.hook == nullptr)
+    {
+        lua_sethook(L, nullptr, 0, 0);
+        return false;
+    }
+    // nothing is hot, or a return on a thread with no recorded call: dropped without the lookup
+    if (pd.adaptive.hot_functions.empty() || (ar->event == LUA_HOOKRET && pd.get_function_data_stack(L).empty()))
+    {
+        ++pd.adaptive.rejected_events;
+        return false;
+    }
+    lua_getinfo(L, "f", ar);
+    auto function = lua_topointer(L, -1);
+    lua_pop(L, 1);
+    return pd.adaptive.accept(function, ar->event);
+}
+
+// hook features chosen by profiler.start{...}, each combination is a separate instantiation so
+// disabled ones cost nothing in the hook
+template <bool coroutine_support, bool tail_call_tracking, bool overhead_compensation, bool name_collection, typename clock_type, bool cpu_time_recording, bool adaptive_filtering, bool perf_counter_recording>
+struct hook_features
+{
+    static constexpr bool coroutine = coroutine_support;         // track coroutine stacks, otherwise only main thread is recorded
+    static constexpr bool tail_call = tail_call_tracking;        // record tail called functions, otherwise fold them into the caller
+    static constexpr bool compensation = overhead_compensation; // exclude time spent in the hook from the result
+    static constexpr bool name = name_collection;                // call site function names, otherwise named after source
+    using clock_t = clock_type;
+    static constexpr bool cpu_time = cpu_time_recording; // read thread cpu clock along with clock_t
+    static constexpr bool adaptive = adaptive_filtering; // only hot functions, see adaptive_profile
+    static constexpr bool perf_counters = perf_counter_recording; // read hardware counters along with clock_t
+};
+
+enum hook_feature_bit : size_t
+{
+    hook_no_coroutine = 1 << 0,
+    hook_no_tail_call = 1 << 1,
+    hook_no_compensation = 1 << 2,
+    hook_no_name = 1 << 3,
+    hook_coarse_clock = 1 << 4,
+    hook_cpu_time = 1 << 5,
+    hook_adaptive = 1 << 6,
+    hook_perf_counters = 1 << 7,
+    hook_feature_combinations = 1 << 8,
+};
+
+template <size_t feature_bits>
+using hook_features_of = hook_features<(feature_bits & hook_no_coroutine) == 0,
+                                       (feature_bits & hook_no_tail_call) == 0,
+                                       (feature_bits & hook_no_compensation) == 0,
+                                       (feature_bits & hook_no_name) == 0,
+                                       std::conditional_t<(feature_bits & hook_coarse_clock) != 0, coarse_clock, record_clock_t>,
+                                       (feature_bits & hook_cpu_time) != 0,
+                                       (feature_bits & hook_adaptive) != 0,
+                                       (feature_bits & hook_perf_counters) != 0>;
+
+template <typename features>
+struct auto_time
+{
+    time_point_t begin_time;
+    time_point_t cpu_begin_time = {};
+    perf_counter_values perf_begin;
+    lua_State *L;
+    profile_data *pd; // owned by the registry, which the hook does not change
+    std::string function_name = "";
+    std::string function_source = "";
+    int event = -1;
+    bool is_pushed = false;
+    bool is_skipped = false;
+
+    auto_time(lua_State *_L, profile_data *_pd)
+    {
+        begin_time = features::clock_t::now();
+        if constexpr (features::cpu_time)
+        {
+            cpu_begin_time = thread_cpu_clock::now();
+        }
+        if constexpr (features::perf_counters)
+        {
+            perf_begin = perf_counters::current().read();
+        }
+        L = _L;
+        pd = _pd;
+        if (pd->hook == nullptr)
+        {
+            lua_sethook(L, nullptr, 0, 0); // stopped, a thread stop did not see
+            is_skipped = true;
+            return;
+        }
+        if constexpr (!features::coroutine)
+        {
+            is_skipped = !pd->is_main_thread(L);
+        }
+    }
+
+    function_stack_t &get_function_data_stack(lua_State *co, std::string *name = nullptr)
+    {
+        if constexpr (features::coroutine)
+        {
+            return pd->get_function_data_stack(co, name);
+        }
+        else
+        {
+            return pd->main_thread_stack;
+        }
+    }
+
+    ~auto_time()
+    {
+        if (is_skipped)
+        {
+            return;
+        }
+        scope_on_exit _([&]() {
+            if (!function_name.empty())
+            {
+                // samples leave the switch to the next recorded event
+                pd->last_thread_of_hook = L;
+                pd->last_coroutine_of_hook = pd->find_coroutine(L);
+            }
+            if (pd->live.is_enabled && begin_time >= pd->live.next_publish_time)
+            {
+                publish_live_export(*pd, begin_time);
+            }
+
+            if constexpr (features::compensation)
+            {
+                if (!is_pushed)
+                {
+                    pd->last_tool_begin = begin_time;
+                    pd->last_tool_end = features::clock_t::now();
+                    if constexpr (features::cpu_time)
+                    {
+                        pd->cpu_last_tool_begin = cpu_begin_time;
+                        pd->cpu_last_tool_end = thread_cpu_clock::now();
+                    }
+                    if constexpr (features::perf_counters)
+                    {
+                        pd->perf_last_tool_begin = perf_begin;
+                        pd->perf_last_tool_end = perf_counters::current().read();
+                    }
+                }
+                else
+                {
+                    pd->last_tool_begin = {};
+                    pd->last_tool_end = {};
+                    auto &stack = get_function_data_stack(L);
+                    stack.back().call_end_time = features::clock_t::now();
+                    if constexpr (features::cpu_time)
+                    {
+                        pd->cpu_last_tool_begin = {};
+                        pd->cpu_last_tool_end = {};
+                        stack.cpu_time_back().call_end = thread_cpu_clock::now();
+                    }
+                    if constexpr (features::perf_counters)
+                    {
+                        pd->perf_last_tool_begin = {};
+                        pd->perf_last_tool_end = {};
+                        stack.perf_counters_back().call_end = perf_counters::current().read();
+                    }
+                }
+            }
+            else if (is_pushed)
+            {
+                auto &stack = get_function_data_stack(L);
+                stack.back().call_end_time = begin_time;
+                if constexpr (features::cpu_time)
+                {
+                    stack.cpu_time_back().call_end = cpu_begin_time;
+                }
+                if constexpr (features::perf_counters)
+                {
+                    stack.perf_counters_back().call_end = perf_begin;
+                }
+            }
+        });
+
+        if constexpr (features::compensation)
+        {
+            // delay calculate tool time
+            if (auto &last_function_data_stack = pd->get_last_thread_stack(); !last_function_data_stack.empty())
+            {
+                last_function_data_stack.back().children_tool_time += (pd->last_tool_end - pd->last_tool_begin);
+                if constexpr (features::cpu_time)
+                {
+                    last_function_data_stack.cpu_time_back().children_tool += (pd->cpu_last_tool_end - pd->cpu_last_tool_begin);
+                }
+                if constexpr (features::perf_counters)
+                {
+                    last_function_data_stack.perf_counters_back().children_tool += (pd->perf_last_tool_end - pd->perf_last_tool_begin);
+                }
+            }
+        }
+
+        if (function_name.empty())
+        {
+            return; // only tool time, a sample or an unnamed c function
+        }
+        function_time_data *parent = nullptr;
+        auto &function_data_stack = get_function_data_stack(L, &function_name);
+        // the graph keeps the call paths, the tree only one node per function below root
+        parent = function_data_stack.empty() || pd->graph.is_enabled ? pd->root.get() : function_data_stack.back().node;
+        if constexpr (!features::tail_call)
+        {
+            if (event == LUA_HOOKTAILCALL)
+            {
+                // the caller frame is gone, let it wait for the return of its tail callee
+                if (!function_data_stack.empty())
+                {
+                    function_data_stack.back().function_source = function_source;
+                }
+                return;
+            }
+        }
+
+        function_time_data *this_function_data = nullptr;
+        if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL)
+        {
+            auto itr = parent->children.find(function_name);
+            if (itr == parent->children.end())
+            {
+                this_function_data = pd->new_child(*parent, function_name, function_source).get();
+            }
+            else
+            {
+                this_function_data = itr->second.get();
+            }
+        }
+
+        if constexpr (features::coroutine)
+        {
+            if (L != pd->last_thread_of_hook)
+            {
+                if (auto &last_coroutine_stack = pd->get_last_thread_stack(); !last_coroutine_stack.empty())
+                {
+                    last_coroutine_stack.back().new_thread_begin_time = begin_time;
+                    if constexpr (features::cpu_time)
+                    {
+                        last_coroutine_stack.cpu_time_back().new_thread_begin = cpu_begin_time;
+                    }
+                    if constexpr (features::perf_counters)
+                    {
+                        last_coroutine_stack.perf_counters_back().new_thread_begin = perf_begin;
+                    }
+                }
+            }
+        }
+
+        if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL)
+        {
+            uint32_t graph_function = call_graph::root_id;
+            uint32_t graph_edge = call_graph::no_id;
+            bool is_graph_outermost_function = false;
+            bool is_graph_outermost_edge = false;
+            if (pd->graph.is_enabled)
+            {
+                graph_function = pd->graph.intern(*this_function_data);
+                graph_edge = pd->graph.on_call(function_data_stack.empty() ? call_graph::root_id : function_data_stack.back().graph_function, graph_function);
+                // recursion only counts on this stack, a coroutine suspended inside the function
+                // does not hide the calls of other stacks
+                is_graph_outermost_function = function_data_stack.graph_function_depths[graph_function]++ == 0;
+                is_graph_outermost_edge = function_data_stack.graph_edge_depths[graph_edge]++ == 0;
+            }
+            this_function_data->count++;
+            if (this_function_data->source_data != nullptr)
+            {
+                this_function_data->source_data->count++;
+            }
+            if (pd->frames.is_enabled)
+            {
+                pd->frames.touch(*this_function_data);
+            }
+            if (pd->flight.is_enabled)
+            {
+                pd->flight.on_call(*this_function_data, begin_time);
+            }
+            auto &node = function_data_stack.push_back();
+            node.function_source = std::move(function_source);
+            node.call_begin_time = begin_time;
+            node.node = this_function_data;
+            node.graph_function = graph_function;
+            node.graph_edge = graph_edge;
+            node.is_graph_outermost_function = is_graph_outermost_function;
+            node.is_graph_outermost_edge = is_graph_outermost_edge;
+            node.is_tail_call = (event == LUA_HOOKTAILCALL);
+            if constexpr (features::cpu_time)
+            {
+                function_data_stack.cpu_time_back().call_begin = cpu_begin_time;
+            }
+            if constexpr (features::perf_counters)
+            {
+                function_data_stack.perf_counters_back().call_begin = perf_begin;
+            }
+            is_pushed = true;
+
+            return;
+        }
+        else
+        {
+            ++pd->generation; // times of the popped calls change
+            if constexpr (features::coroutine)
+            {
+                if (L != pd->last_thread_of_hook)
+                {
+                    on_coroutine_switch(function_data_stack);
+                }
+            }
+            if constexpr (features::adaptive)
+            {
+                // became hot while running, its call was not recorded
+                if (!function_data_stack.empty() && function_data_stack.back().function_source != function_source)
+                {
+                    auto source = pd->source_map.find(function_source);
+                    if (source == pd->source_map.end() || !stack_contains(function_data_stack, &source->second))
+                    {
+                        return;
+                    }
+                }
+            }
+            // for mismatch after error or return before yield
+            bool is_tail_call_popped = false;
+            while ((!function_data_stack.empty()) &&
+                   (function_data_stack.back().function_source != function_source))
+            {
+                calculate_time<features::cpu_time, features::perf_counters>(function_data_stack, pd->frames, pd->flight, pd->graph, pd->live, begin_time, cpu_begin_time, perf_begin, is_tail_call_popped);
+            }
+
+            if (function_data_stack.empty())
+            {
+                return;
+            }
+            else
+            {
+                assert(function_data_stack.back().function_source == function_source);
+            }
+
+            assert(is_tail_call_popped == false);
+            // for normal ret
+            calculate_time<features::cpu_time, features::perf_counters>(function_data_stack, pd->frames, pd->flight, pd->graph, pd->live, begin_time, cpu_begin_time, perf_begin, is_tail_call_popped);
+            // for taill call
+            if constexpr (features::tail_call)
+            {
+                while ((!function_data_stack.empty()) && is_tail_call_popped)
+                {
+                    calculate_time<features::cpu_time, features::perf_counters>(function_data_stack, pd->frames, pd->flight, pd->graph, pd->live, begin_time, cpu_begin_time, perf_begin, is_tail_call_popped);
+                }
+            }
+        }
+    }
+
+    // times the suspended top of a stack stopped at
+    void record_last_time(function_stack_t &function_data_stack)
+    {
+        function_data_stack.back().last_record_time = begin_time;
+        if constexpr (features::cpu_time)
+        {
+            function_data_stack.cpu_time_back().last_record = cpu_begin_time;
+        }
+        if constexpr (features::perf_counters)
+        {
+            function_data_stack.perf_counters_back().last_record = perf_begin;
+        }
+    }
+
+    void on_coroutine_switch(function_stack_t &function_data_stack)
+    {
+        auto last_thread = pd->last_thread_of_hook;
+        auto last_coroutine = pd->last_coroutine_of_hook; // nullptr for main thread
+        if (last_coroutine != nullptr)
+        {
+            bool is_dead = false;
+            if (last_coroutine->is_resume_status_known)
+            {
+                is_dead = last_coroutine->is_dead;
+                last_coroutine->is_resume_status_known = false;
+            }
+            else
+            {
+                is_dead = is_couroutine_dead(L, last_thread); // resumed by lua_resume from c
+            }
+
+            auto &last_function_data_stack = last_coroutine->coroutine_stack;
+            if (is_dead)
+            {
+                bool is_tail_call_popped = false;
+                while (!last_function_data_stack.empty())
+                {
+                    calculate_time<features::cpu_time, features::perf_counters>(last_function_data_stack, pd->frames, pd->flight, pd->graph, pd->live, begin_time, cpu_begin_time, perf_begin, is_tail_call_popped);
+                }
+            }
+            else if (!last_function_data_stack.empty())
+            {
+                record_last_time(last_function_data_stack);
+            }
+        }
+        else if (auto &last_function_data_stack = pd->get_last_thread_stack(); !last_function_data_stack.empty())
+        {
+            record_last_time(last_function_data_stack);
+        }
+
+        if (!function_data_stack.empty())
+        {
+            auto &top = function_data_stack.back();
+            auto this_coroutine_time = (begin_time - top.call_end_time);
+            auto trans_function_time = top.new_thread_begin_time - top.call_end_time;
+            top.children_coroutine_time += (this_coroutine_time - trans_function_time);
+            if constexpr (features::cpu_time)
+            {
+                auto &cpu_top = function_data_stack.cpu_time_back();
+                auto cpu_this_coroutine_time = (cpu_begin_time - cpu_top.call_end);
+                auto cpu_trans_function_time = cpu_top.new_thread_begin - cpu_top.call_end;
+                cpu_top.children_coroutine += (cpu_this_coroutine_time - cpu_trans_function_time);
+            }
+            if constexpr (features::perf_counters)
+            {
+                auto &perf_top = function_data_stack.perf_counters_back();
+                auto perf_this_coroutine = perf_begin - perf_top.call_end;
+                auto perf_trans_function = perf_top.new_thread_begin - perf_top.call_end;
+                perf_top.children_coroutine += (perf_this_coroutine - perf_trans_function);
+            }
+
+            coroutine_switch_cache uncached;
+            auto &switch_cache = last_coroutine != nullptr        ? last_coroutine->switch_cache
+                                 : pd->is_main_thread(last_thread) ? pd->main_thread_switch_cache
+                                                                   : uncached;
+            if (switch_cache.resumer_node != top.node)
+            {
+                std::string coroutine_function_name = pd->get_coroutine_name(last_thread, last_coroutine);
+                auto itr = top.node->children.find(coroutine_function_name);
+                if (itr == top.node->children.end())
+                {
+                    switch_cache.coroutine_node = pd->new_child(*top.node, coroutine_function_name, "").get();
+                }
+                else
+                {
+                    switch_cache.coroutine_node = itr->second.get();
+                }
+                switch_cache.resumer_node = top.node;
+            }
+            switch_cache.coroutine_node->count++;
+        }
+    }
+};
+
+template <typename features>
+static void profile_hooker(lua_State *L, lua_Debug *ar)
+{
+    auto pd = find_pd_from_lua(L);
+    if (pd == nullptr)
+    {
+        lua_sethook(L, nullptr, 0, 0); // cleared, a thread stop did not see
+        return;
+    }
+    if constexpr (features::adaptive)
+    {
+        if (ar->event == LUA_HOOKCOUNT)
+        {
+            // the stack walk of a precise phase sample is tool time like the rest of the hook
+            auto_time<features> t(L, pd);
+            if (!t.is_skipped || pd->hook != nullptr)
+            {
+                adaptive_sample(L, *pd);
+            }
+            return;
+        }
+        if (!accept_adaptive_event(L, ar, *pd))
+        {
+            return;
+        }
+    }
+    auto_time<features> t(L, pd);
+    if (t.is_skipped)
+    {
+        return;
+    }
+    lua_getinfo(L, features::name ? "Sn" : "S", ar);
+    t.event = ar->event;
+    bool is_c_function = (std::strcmp("C", ar->what) == 0);
+    const char *name = nullptr;
+    if constexpr (features::name)
+    {
+        if (is_c_function && (ar->name == nullptr))
+        {
+            // a internal c function ?
+            return;
+        }
+        name = ar->name;
+    }
+
+    if (is_c_function)
+    {
+        lua_getinfo(L, "f", ar);
+        t.function_source = fmt::format("c:{}",
+                                        lua_topointer(L, -1));
+        lua_pop(L, 1);
+    }
+    else
+    {
+        t.function_source = fmt::format("lua:{}:{}",
+                                        ar->short_src,
+                                        ar->linedefined);
+    }
+
+    if (!features::name && is_c_function)
+    {
+        t.function_name = fmt::format("?:{}", t.function_source);
+    }
+    else
+    {
+        t.function_name = fmt::format("{}:{}:{}",
+                                      name == nullptr ? "?" : name,
+                                      ar->short_src,
+                                      ar->linedefined);
+    }
+}
+
+template <size_t... feature_bits>
+static constexpr std::array<lua_Hook, sizeof...(feature_bits)> make_profile_hookers(std::index_sequence<feature_bits...>)
+{
+    return {profile_hooker<hook_features_of<feature_bits>>...};
+}
+
+static const auto profile_hookers = make_profile_hookers(std::make_index_sequence<hook_feature_combinations>());
+
+static void format_extra_columns(std::string &out, const function_time_data &data, const report_columns &columns)
+{
+    if (columns.cpu_time)
+    {
+        fmt::format_to(std::back_inserter(out), " cpu_total:{:<20} cpu_self:{:<16} cpu_children:{:<16}",
+                       data.get_cpu_time().total_time.count(),
+                       data.get_cpu_time().self_time.count(),
+                       data.get_cpu_time().children_time.count());
+    }
+    if (columns.perf_counters)
+    {
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            fmt::format_to(std::back_inserter(out), " {}:{:<16} {}_self:{:<16}",
+                           perf_counter_names[i], data.get_perf_counters().total.values[i],
+                           perf_counter_names[i], data.get_perf_counters().self.values[i]);
+        }
+    }
+}
+
+static void format_tree_line(std::string &out, const function_time_data &current, size_t current_stack, size_t max_name_length, const report_columns &columns)
+{
+    size_t intent_length = current_stack * per_indent_length;
+    size_t intent_name_length = intent_length + current.function_name.length();
+    size_t align_length = max_name_length > intent_name_length ? (max_name_length - intent_name_length) : 2;
+
+    fmt::format_to(std::back_inserter(out), "{:{}}{}{:{}} count:{:<10} total:{:<20} self:{:<16} children:{:<16}",
+                   "", intent_length,
+                   current.function_name,
+                   "", align_length,
+                   current.count,
+                   current.total_time.count(),
+                   current.self_time.count(),
+                   current.children_time.count());
+    format_extra_columns(out, current, columns);
+    out.push_back('\n');
+}
+
+static void print_tree(std::ostream &os, function_time_data &root, size_t max_name_length, size_t max_stack, size_t thread_count, const report_columns &columns)
+{
+    if (thread_count <= 1)
+    {
+        std::string line;
+        traverse_tree<sort_t::total_time>(root, max_stack, [&](function_time_data &current, size_t current_stack) {
+            line.clear();
+            format_tree_line(line, current, current_stack, max_name_length, columns);
+            os.write(line.data(), line.size());
+        });
+        return;
+    }
+
+    struct tree_report_unit
+    {
+        function_time_data *node;
+        size_t stack;
+        bool is_subtree; // false for the line of node itself only
+    };
+
+    // split subtrees in output order until every thread has enough units to balance the load
+    std::vector<tree_report_unit> units = {{&root, 0, true}};
+    std::vector<tree_report_unit> split_units;
+    std::vector<function_time_data *> sorted_children;
+    size_t min_unit_count = thread_count * 16;
+    bool is_split = true;
+    while (units.size() < min_unit_count && is_split)
+    {
+        is_split = false;
+        split_units.clear();
+        for (auto &&unit : units)
+        {
+            if (!unit.is_subtree || unit.node->children.empty() || (max_stack > 0 && max_stack < unit.stack))
+            {
+                split_units.push_back(unit);
+                continue;
+            }
+            split_units.push_back({unit.node, unit.stack, false});
+            sort_children<sort_t::total_time>(*unit.node, sorted_children);
+            for (auto itr = sorted_children.rbegin(); itr != sorted_children.rend(); ++itr)
+            {
+                split_units.push_back({*itr, unit.stack + 1, true});
+            }
+            is_split = true;
+        }
+        units.swap(split_units);
+    }
+
+    std::vector<std::string> outputs(units.size());
+    parallel_for(units.size(), thread_count, [&](size_t i) {
+        auto &unit = units[i];
+        auto &out = outputs[i];
+        if (unit.is_subtree)
+        {
+            traverse_tree<sort_t::total_time>(*unit.node, max_stack, [&](function_time_data &current, size_t current_stack) {
+                format_tree_line(out, current, current_stack, max_name_length, columns);
+            },
+                                              unit.stack);
+        }
+        else
+        {
+            format_tree_line(out, *unit.node, unit.stack, max_name_length, columns);
+        }
+    });
+    for (auto &&out : outputs)
+    {
+        os.write(out.data(), out.size());
+    }
+}
+
+static void print_list(std::ostream &os, profile_data &pd, size_t max_top, size_t thread_count)
+{
+    auto &sorted_data = pd.get_sorted_source_data(thread_count);
+    size_t data_size = sorted_data.size();
+    if (max_top > 0 && max_top < data_size)
+    {
+        data_size = max_top;
+    }
+
+    size_t max_function_name_length = 0;
+    for (size_t i = 0; i < data_size; ++i)
+    {
+        max_function_name_length = std::max(max_function_name_length, sorted_data[i]->function_name.length());
+    }
+
+    std::string line;
+    for (size_t i = 0; i < data_size; ++i)
+    {
+        auto &data = *sorted_data[i];
+        line.clear();
+        fmt::format_to(std::back_inserter(line), "{:{}} count:{:<10} total:{:<20} self:{:<16} children:{:<16}",
+                       data.function_name, max_function_name_length + space_after_name,
+                       data.count,
+                       data.total_time.count(),
+                       data.self_time.count(),
+                       data.children_time.count());
+        format_extra_columns(line, data, pd.get_report_columns());
+        line.push_back('\n');
+        os.write(line.data(), line.size());
+    }
+}
+
+static std::string children_key = "children";
+
+// static void print_json(std::ostream &os, function_time_data_t &root)
+// {
+//     json j = json::object();
+//     std::stack<json::value_type *> parent_stack;
+//     parent_stack.push(&j);
+
+//     traverse_tree<sort_t::total_time>(root, 0, [&](function_time_data_t &current, size_t current_stack) {
+//         size_t parent_size = current_stack + 1;
+//         json currentj = json::object();
+//         currentj["function_name"] = current->function_name;
+//         currentj["function_source"] = current->function_source;
+//         currentj["count"] = current->count;
+//         currentj["self_time"] = current->self_time.count();
+//         currentj["children_time"] = current->children_time.count();
+//         currentj["total_time"] = current->total_time.count();
+
+//         while (parent_stack.size() > parent_size)
+//         {
+//             parent_stack.pop();
+//         }
+
+//         auto &parent_children = (*parent_stack.top())[children_key];
+//         if (parent_children.is_null())
+//         {
+//             parent_children = json::array();
+//         }
+//         parent_children.push_back(currentj);
+//         parent_stack.push(&parent_children.back());
+//     });
+//     os << j[children_key][0].dump(); // serialize from root;
+// }
+static void print_json(std::ostream &os, function_time_data &root, const report_columns &columns)
+{
+    using namespace rapidjson;
+    using jvar = Document::ValueType;
+    using json = Document;
+    json j(kObjectType);
+    auto &a = j.GetAllocator();
+    std::stack<jvar *> parent_stack;
+    parent_stack.push(&j);
+
+    traverse_tree<sort_t::total_time>(root, 0, [&](function_time_data &current, size_t current_stack) {
+        size_t parent_size = current_stack + 1;
+        jvar currentj(kObjectType);
+        currentj.AddMember("function_name", jvar(current.function_name.c_str(), a), a);
+        currentj.AddMember("function_source", jvar(current.function_source.c_str(), a), a);
+        currentj.AddMember("count", jvar(current.count), a);
+        currentj.AddMember("self_time", current.self_time.count(), a);
+        currentj.AddMember("children_time", current.children_time.count(), a);
+        currentj.AddMember("total_time", current.total_time.count(), a);
+        if (columns.cpu_time)
+        {
+            auto &cpu = current.get_cpu_time();
+            currentj.AddMember("cpu_self_time", cpu.self_time.count(), a);
+            currentj.AddMember("cpu_children_time", cpu.children_time.count(), a);
+            currentj.AddMember("cpu_total_time", cpu.total_time.count(), a);
+        }
+        if (columns.perf_counters)
+        {
+            for (size_t i = 0; i < perf_counter_count; ++i)
+            {
+                auto name = std::string(perf_counter_names[i]);
+                currentj.AddMember(jvar((name + "_self").c_str(), a), current.get_perf_counters().self.values[i], a);
+                currentj.AddMember(jvar((name + "_total").c_str(), a), current.get_perf_counters().total.values[i], a);
+            }
+        }
+
+        while (parent_stack.size() > parent_size)
+        {
+            parent_stack.pop();
+        }
+        auto &parent = *parent_stack.top();
+        auto parent_children_itr = parent.FindMember(children_key.c_str());
+        jvar *parent_children = nullptr;
+        if (parent_children_itr == parent.MemberEnd())
+        {
+            jvar children_array(kArrayType);
+            parent.AddMember(jvar(children_key.c_str(), a), children_array, a);
+            parent_children = &(parent[jvar(children_key.c_str(), a)]);
+        }
+        else
+        {
+            parent_children = &parent_children_itr->value;
+        }
+        parent_children->PushBack(currentj, a);
+        parent_stack.push(&((*parent_children)[parent_children->Size() - 1]));
+    });
+    StringBuffer buffer;
+    Writer<StringBuffer> writer(buffer);
+    j[jvar(children_key.c_str(), a)][0].Accept(writer); // serialize from root;
+    os << buffer.GetString();
+}
+
+// protocol buffers wire format, just what profile.proto needs
+struct protobuf_writer
+{
+    std::string &buffer;
+
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<char>(value));
+    }
+
+    void integer_field(uint32_t field, int64_t value)
+    {
+        varint((uint64_t(field) << 3) | 0);
+        varint(static_cast<uint64_t>(value));
+    }
+
+    void bytes_field(uint32_t field, const std::string &value)
+    {
+        varint((uint64_t(field) << 3) | 2);
+        varint(value.size());
+        buffer.append(value);
+    }
+};
+
+// gzip when built with zlib
+class pprof_file
+{
+public:
+    explicit pprof_file(const std::string &file_name)
+    {
+#if defined(LUA_PROFILER_WITH_ZLIB)
+        gz = gzopen(file_name.c_str(), "wb");
+#else
+        os.open(file_name, std::ios::binary);
+#endif
+    }
+
+    ~pprof_file()
+    {
+#if defined(LUA_PROFILER_WITH_ZLIB)
+        if (gz != nullptr)
+        {
+            gzclose(gz);
+        }
+#endif
+    }
+
+    static const char *extension()
+    {
+#if defined(LUA_PROFILER_WITH_ZLIB)
+        return "pb.gz";
+#else
+        return "pb";
+#endif
+    }
+
+    void write(const std::string &data)
+    {
+#if defined(LUA_PROFILER_WITH_ZLIB)
+        if (gz != nullptr && !data.empty())
+        {
+            gzwrite(gz, data.data(), static_cast<unsigned>(data.size()));
+        }
+#else
+        os.write(data.data(), data.size());
+#endif
+    }
+
+private:
+#if defined(LUA_PROFILER_WITH_ZLIB)
+    gzFile gz = nullptr;
+#else
+    std::ofstream os;
+#endif
+};
+
+// profile.proto written while walking the tree: one sample per node with the node's stack as locations,
+// strings, functions and locations (one per function, at linedefined) are emitted when first seen
+static void write_pprof(pprof_file &file, function_time_data &root, const report_columns &columns)
+{
+    enum profile_field : uint32_t
+    {
+        profile_sample_type = 1,
+        profile_sample = 2,
+        profile_location = 4,
+        profile_function = 5,
+        profile_string_table = 6,
+        profile_time_nanos = 9,
+        profile_duration_nanos = 10,
+        profile_default_sample_type = 14,
+    };
+    std::string out;
+    std::string message;
+    std::string packed;
+    protobuf_writer profile{out};
+    protobuf_writer writer{message};
+    protobuf_writer packed_writer{packed};
+    std::unordered_map<std::string, int64_t> string_table;
+    std::unordered_map<std::string, uint64_t> function_ids;
+    std::vector<uint64_t> location_stack;
+
+    auto intern = [&](const std::string &value) {
+        auto [itr, is_new] = string_table.try_emplace(value, string_table.size());
+        if (is_new)
+        {
+            profile.bytes_field(profile_string_table, value);
+        }
+        return itr->second;
+    };
+    auto flush = [&](size_t min_size) {
+        if (out.size() >= min_size)
+        {
+            file.write(out);
+            out.clear();
+        }
+    };
+
+    intern("");
+    // pprof adds up the samples of a stack and its callees for cumulative views,
+    // so only self values are samples and inclusive ones are derived from them
+    std::vector<std::pair<const char *, const char *>> sample_types = {{"calls", "count"}, {"self_time", "nanoseconds"}};
+    if (columns.cpu_time)
+    {
+        sample_types.push_back({"cpu_self_time", "nanoseconds"});
+    }
+    std::vector<std::string> perf_sample_types;
+    if (columns.perf_counters)
+    {
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            perf_sample_types.push_back(fmt::format("{}_self", perf_counter_names[i]));
+        }
+        for (auto &&perf_sample_type : perf_sample_types)
+        {
+            sample_types.push_back({perf_sample_type.c_str(), "count"});
+        }
+    }
+    for (auto &&sample_type : sample_types)
+    {
+        auto type = intern(sample_type.first);
+        auto unit = intern(sample_type.second);
+        message.clear();
+        writer.integer_field(1, type);
+        writer.integer_field(2, unit);
+        profile.bytes_field(profile_sample_type, message);
+    }
+    profile.integer_field(profile_default_sample_type, intern("self_time"));
+    profile.integer_field(profile_time_nanos, duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count());
+    profile.integer_field(profile_duration_nanos, duration_cast<nanoseconds>(root.total_time).count());
+
+    traverse_tree<sort_t::none>(root, 0, [&](function_time_data &current, size_t current_stack) {
+        if (current_stack == 0)
+        {
+            return; // root
+        }
+
+        const auto &function_key = current.function_source.empty() ? current.function_name : current.function_source;
+        auto [itr, is_new] = function_ids.try_emplace(function_key, function_ids.size() + 1);
+        auto function_id = itr->second;
+        if (is_new)
+        {
+            // "lua:file:linedefined" or "c:address", the name without its ":file:linedefined" suffix
+            const auto &full_name = current.source_data != nullptr ? current.source_data->function_name : current.function_name;
+            std::string file_name = "[C]";
+            std::string suffix = current.function_source.empty() ? "" : ":[C]:-1";
+            int64_t line = 0;
+            if (current.function_source.compare(0, 4, "lua:") == 0)
+            {
+                auto line_separator = current.function_source.rfind(':');
+                file_name = current.function_source.substr(4, line_separator - 4);
+                line = std::strtoll(current.function_source.c_str() + line_separator + 1, nullptr, 10);
+                suffix = current.function_source.substr(3);
+            }
+            auto name = full_name;
+            if (!suffix.empty() && name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+            {
+                name.resize(name.size() - suffix.size());
+            }
+
+            auto name_index = intern(name);
+            auto system_name_index = intern(full_name);
+            auto file_name_index = intern(file_name);
+            message.clear();
+            writer.integer_field(1, function_id);
+            writer.integer_field(2, name_index);
+            writer.integer_field(3, system_name_index);
+            writer.integer_field(4, file_name_index);
+            writer.integer_field(5, line);
+            profile.bytes_field(profile_function, message);
+
+            // one location per function, with the same id
+            std::string location_line;
+            protobuf_writer line_writer{location_line};
+            line_writer.integer_field(1, function_id);
+            line_writer.integer_field(2, line);
+            message.clear();
+            writer.integer_field(1, function_id);
+            writer.bytes_field(4, location_line);
+            profile.bytes_field(profile_location, message);
+        }
+
+        location_stack.resize(current_stack - 1);
+        location_stack.push_back(function_id);
+        if (current.count == 0 && current.total_time.count() == 0)
+        {
+            return; // placeholder nodes like coroutine names
+        }
+
+        message.clear();
+        packed.clear();
+        for (auto location = location_stack.rbegin(); location != location_stack.rend(); ++location)
+        {
+            packed_writer.varint(*location); // leaf first
+        }
+        writer.bytes_field(1, packed);
+        packed.clear();
+        packed_writer.varint(current.count);
+        packed_writer.varint(static_cast<uint64_t>(duration_cast<nanoseconds>(current.self_time).count()));
+        if (columns.cpu_time)
+        {
+            packed_writer.varint(static_cast<uint64_t>(duration_cast<nanoseconds>(current.get_cpu_time().self_time).count()));
+        }
+        if (columns.perf_counters)
+        {
+            for (auto &&value : current.get_perf_counters().self.values)
+            {
+                packed_writer.varint(static_cast<uint64_t>(std::max<int64_t>(value, 0)));
+            }
+        }
+        writer.bytes_field(2, packed);
+        profile.bytes_field(profile_sample, message);
+        flush(1 << 16);
+    });
+    flush(0);
+}
+
+// gprof like: for each function by total time, its callers ("<-") then itself then its callees ("->"),
+// edge times are the times of the callee when called along the edge
+static void print_graph(std::ostream &os, const call_graph &graph, const function_time_data &root, size_t max_top)
+{
+    auto total_time_of = [&](uint32_t id) {
+        return id == call_graph::root_id ? root.total_time : graph.functions[id].total_time;
+    };
+    std::vector<uint32_t> sorted_functions(graph.functions.size());
+    std::iota(sorted_functions.begin(), sorted_functions.end(), 0);
+    std::stable_sort(sorted_functions.begin(), sorted_functions.end(), [&](uint32_t l, uint32_t r) {
+        return total_time_of(l) > total_time_of(r);
+    });
+    if (max_top > 0 && max_top < sorted_functions.size())
+    {
+        sorted_functions.resize(max_top);
+    }
+
+    size_t max_name_length = 0;
+    for (auto &&function : graph.functions)
+    {
+        max_name_length = std::max(max_name_length, function.function_name.length());
+    }
+    max_name_length += per_indent_length + space_after_name;
+
+    std::string out;
+    std::vector<uint32_t> sorted_edges;
+    auto format_line = [&](const char *prefix, const std::string &name, uint64_t count, time_unit_t total_time, time_unit_t self_time) {
+        fmt::format_to(std::back_inserter(out), "{:<{}}{:{}} count:{:<10} total:{:<20} self:{:<16}\n",
+                       prefix, per_indent_length,
+                       name, max_name_length - per_indent_length,
+                       count,
+                       total_time.count(),
+                       self_time.count());
+    };
+    auto format_edges = [&](const std::vector<uint32_t> &edge_ids, const char *prefix, bool is_callers) {
+        sorted_edges = edge_ids;
+        std::stable_sort(sorted_edges.begin(), sorted_edges.end(), [&](uint32_t l, uint32_t r) {
+            return graph.edges[l].total_time > graph.edges[r].total_time;
+        });
+        for (auto &&edge_id : sorted_edges)
+        {
+            auto &edge = graph.edges[edge_id];
+            auto &other = graph.functions[is_callers ? edge.caller : edge.callee];
+            format_line(prefix, other.function_name, edge.count, edge.total_time, edge.self_time);
+        }
+    };
+    for (auto &&id : sorted_functions)
+    {
+        auto &function = graph.functions[id];
+        out.clear();
+        format_edges(function.caller_edges, "<-", true);
+        format_line("", function.function_name, function.count, total_time_of(id), function.self_time);
+        format_edges(function.callee_edges, "->", false);
+        out.push_back('\n');
+        os.write(out.data(), out.size());
+    }
+}
+
+// format_extra_columns of per frame values, divided by the frame count for averages
+static void format_frame_columns(std::string &out, const frame_time_data &data, const report_columns &columns, int64_t divisor = 1)
+{
+    if (columns.cpu_time)
+    {
+        fmt::format_to(std::back_inserter(out), " cpu_total:{:<20} cpu_self:{:<16}",
+                       data.cpu_total_time.count() / divisor,
+                       data.cpu_self_time.count() / divisor);
+    }
+    if (columns.perf_counters)
+    {
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            fmt::format_to(std::back_inserter(out), " {}:{:<16} {}_self:{:<16}",
+                           perf_counter_names[i], data.perf_total.values[i] / divisor,
+                           perf_counter_names[i], data.perf_self.values[i] / divisor);
+        }
+    }
+}
+
+static void print_frame_tree(std::ostream &os, function_time_data &root, const frame_data &frame, const report_columns &columns)
+{
+    // nodes recorded in the frame plus their ancestors which are still running
+    std::unordered_map<const function_time_data *, frame_time_data> frame_nodes;
+    std::unordered_map<const function_time_data *, std::vector<const function_time_data *>> frame_children;
+    size_t max_name_length = 0;
+    for (auto &&record : frame.records)
+    {
+        frame_nodes[record.node] = record.data;
+    }
+    for (auto &&record : frame.records)
+    {
+        for (const function_time_data *node = record.node; node->parent != nullptr; node = node->parent)
+        {
+            auto &siblings = frame_children[node->parent];
+            if (std::find(siblings.begin(), siblings.end(), node) != siblings.end())
+            {
+                break;
+            }
+            siblings.push_back(node);
+            frame_nodes.try_emplace(node->parent);
+            max_name_length = std::max(max_name_length, node->function_name.length() + node->stack_depth * per_indent_length);
+        }
+    }
+    for (auto &&children : frame_children)
+    {
+        std::sort(children.second.begin(), children.second.end(), [&](const function_time_data *l, const function_time_data *r) {
+            auto &l_data = frame_nodes[l];
+            auto &r_data = frame_nodes[r];
+            if (l_data.total_time != r_data.total_time)
+            {
+                return l_data.total_time < r_data.total_time;
+            }
+            return l->function_name < r->function_name;
+        });
+    }
+
+    frame_nodes[&root].total_time = frame.duration;
+    std::vector<const function_time_data *> stack = {&root};
+    std::string line;
+    while (!stack.empty())
+    {
+        auto current = stack.back();
+        stack.pop_back();
+        auto &data = frame_nodes[current];
+        size_t intent_length = current->stack_depth * per_indent_length;
+        size_t intent_name_length = intent_length + current->function_name.length();
+        size_t align_length = max_name_length + space_after_name - intent_name_length;
+        line.clear();
+        fmt::format_to(std::back_inserter(line), "{:{}}{}{:{}} count:{:<10} total:{:<20} self:{:<16}",
+                       "", intent_length,
+                       current->function_name,
+                       "", align_length,
+                       data.count,
+                       data.total_time.count(),
+                       data.self_time.count());
+        format_frame_columns(line, data, columns);
+        line.push_back('\n');
+        os.write(line.data(), line.size());
+        if (auto itr = frame_children.find(current); itr != frame_children.end())
+        {
+            stack.insert(stack.end(), itr->second.begin(), itr->second.end()); // pushed ascending, so visited descending
+        }
+    }
+}
+
+static void print_frames(std::ostream &os, profile_data &pd, size_t max_top)
+{
+    auto &frames = pd.frames;
+    auto frame_count = std::max<uint64_t>(frames.frame_count, 1);
+    os << fmt::format("frames:{} average:{} worst:{} (frame {}) budget:{} spikes:{}",
+                      frames.frame_count,
+                      frames.total_duration.count() / frame_count,
+                      frames.worst.duration.count(),
+                      frames.worst.index,
+                      frames.budget.count(),
+                      frames.spike_count)
+       << std::endl;
+
+    os << "recent:";
+    for (size_t i = 0; i < frames.history.size(); ++i)
+    {
+        auto &frame = frames.history[(frames.next_history + i) % frames.history.size()];
+        if (frame.index > 0)
+        {
+            os << " " << frame.duration.count();
+        }
+    }
+    os << std::endl;
+
+    os << "---- average per frame" << std::endl;
+    std::vector<function_time_data *> average_data;
+    size_t max_function_name_length = 0;
+    for (auto &&i : pd.source_map)
+    {
+        if (auto &sum = frames.get_sum(i.second); sum.count > 0 || sum.total_time.count() > 0)
+        {
+            average_data.push_back(&i.second);
+        }
+    }
+    std::sort(average_data.begin(), average_data.end(), [&](function_time_data *l, function_time_data *r) {
+        auto &l_sum = frames.get_sum(*l);
+        auto &r_sum = frames.get_sum(*r);
+        if (l_sum.total_time != r_sum.total_time)
+        {
+            return l_sum.total_time > r_sum.total_time;
+        }
+        return l->function_source < r->function_source;
+    });
+    if (max_top > 0 && max_top < average_data.size())
+    {
+        average_data.resize(max_top);
+    }
+    for (auto &&i : average_data)
+    {
+        max_function_name_length = std::max(max_function_name_length, i->function_name.length());
+    }
+    auto columns = pd.get_report_columns();
+    std::string line;
+    for (auto &&i : average_data)
+    {
+        auto &sum = frames.get_sum(*i);
+        line = fmt::format("{:{}} count:{:<10.2f} total:{:<20} self:{:<16}",
+                           i->function_name, max_function_name_length + space_after_name,
+                           double(sum.count) / frame_count,
+                           sum.total_time.count() / frame_count,
+                           sum.self_time.count() / frame_count);
+        format_frame_columns(line, sum, columns, static_cast<int64_t>(frame_count));
+        os << line << std::endl;
+    }
+
+    if (frames.worst.index > 0)
+    {
+        os << fmt::format("---- worst frame {} duration:{}", frames.worst.index, frames.worst.duration.count()) << std::endl;
+        print_frame_tree(os, *pd.root, frames.worst, columns);
+    }
+
+    for (size_t i = 0; i < frames.spikes.size(); ++i)
+    {
+        auto &frame = frames.spikes[(frames.next_spike + i) % frames.spikes.size()];
+        if (frame.index > 0)
+        {
+            os << fmt::format("---- spike frame {} duration:{}", frame.index, frame.duration.count()) << std::endl;
+            print_frame_tree(os, *pd.root, frame, columns);
+        }
+    }
+}
+
+static int profile_report_tree(lua_State *L)
+{
+    size_t max_stack = 0;
+    if (lua_gettop(L) > 0 && lua_isinteger(L, 1))
+    {
+        max_stack = std::abs(lua_tointeger(L, 1));
+    }
+
+    auto pd = get_or_new_pd_from_lua(L);
+    std::ostringstream os;
+    auto max_function_name_length = pd->get_max_function_name_length(max_stack);
+    print_tree(os, *pd->root, max_function_name_length + space_after_name, max_stack, get_report_thread_count(pd->node_count), pd->get_report_columns());
+    lua_pushstring(L, os.str().c_str());
+    return 1;
+}
+
+static int profile_report_list(lua_State *L)
+{
+    size_t max_top = 0;
+    if (lua_gettop(L) > 0 && lua_isinteger(L, 1))
+    {
+        max_top = std::abs(lua_tointeger(L, 1));
+    }
+
+    auto pd = get_or_new_pd_from_lua(L);
+    std::ostringstream os;
+    print_list(os, *pd, max_top, get_report_thread_count(pd->source_map.size()));
+    lua_pushstring(L, os.str().c_str());
+    return 1;
+}
+
+static bool get_option_boolean(lua_State *L, int index, const char *name, bool default_value)
+{
+    lua_getfield(L, index, name);
+    bool value = lua_isnil(L, -1) ? default_value : lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+enum class query_sort_t : uint8_t
+{
+    total_time,
+    self_time,
+    count,
+};
+
+static int64_t query_sort_key(const function_time_data &node, query_sort_t sort_type)
+{
+    switch (sort_type)
+    {
+    case query_sort_t::self_time:
+        return node.self_time.count();
+    case query_sort_t::count:
+        return static_cast<int64_t>(node.count);
+    default:
+        return node.total_time.count();
+    }
+}
+
+// the node at path below root, path is an array of function names
+static function_time_data *find_query_root(lua_State *L, int index, function_time_data &root)
+{
+    function_time_data *current = &root;
+    if (!lua_istable(L, index))
+    {
+        return current;
+    }
+    auto path_length = static_cast<lua_Integer>(lua_rawlen(L, index));
+    for (lua_Integer i = 1; i <= path_length && current != nullptr; ++i)
+    {
+        lua_rawgeti(L, index, i);
+        size_t name_length = 0;
+        auto name = lua_tolstring(L, -1, &name_length);
+        auto itr = name == nullptr ? current->children.end() : current->children.find(std::string(name, name_length));
+        current = itr == current->children.end() ? nullptr : itr->second.get();
+        lua_pop(L, 1);
+    }
+    return current;
+}
+
+// pushes the cached lua string of a node name, cache table at cache_index
+static void push_query_name(lua_State *L, int cache_index, const function_time_data &data)
+{
+    if (lua_rawgetp(L, cache_index, &data) == LUA_TSTRING)
+    {
+        return;
+    }
+    lua_pop(L, 1);
+    lua_pushlstring(L, data.function_name.data(), data.function_name.size());
+    if (data.function_name.find("?:") != 0) // source data may still get a better name
+    {
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, cache_index, &data);
+    }
+}
+
+// profiler.query{by = "source"|"path", sort = "total"|"self"|"count", top = N, offset = 0, root = {name, ...}, depth = 1, refresh = false}
+// returns a page of {name = , source = , count = , total = , self = , children = [, depth = , child_count = ]}
+// and the number of matched entries, only the requested pages are sorted and converted
+static int profile_query(lua_State *L)
+{
+    int options = lua_istable(L, 1) ? 1 : 0;
+    auto get_string_option = [&](const char *name, const char *default_value) {
+        std::string value = default_value;
+        if (options != 0)
+        {
+            lua_getfield(L, options, name);
+            if (lua_isstring(L, -1))
+            {
+                value = lua_tostring(L, -1);
+            }
+            lua_pop(L, 1);
+        }
+        return value;
+    };
+    auto get_integer_option = [&](const char *name, size_t default_value) {
+        size_t value = default_value;
+        if (options != 0)
+        {
+            lua_getfield(L, options, name);
+            if (lua_isinteger(L, -1))
+            {
+                value = std::abs(lua_tointeger(L, -1));
+            }
+            lua_pop(L, 1);
+        }
+        return value;
+    };
+    auto by = get_string_option("by", "source");
+    auto sort = get_string_option("sort", "total");
+    size_t top = get_integer_option("top", 0);
+    size_t offset = get_integer_option("offset", 0);
+    size_t depth = get_integer_option("depth", 1);
+    bool is_path = by == "path";
+    if (!is_path && by != "source")
+    {
+        return luaL_error(L, "query by %s, expected source or path", by.c_str());
+    }
+    query_sort_t sort_type = sort == "self" ? query_sort_t::self_time : (sort == "count" ? query_sort_t::count : query_sort_t::total_time);
+    bool is_refresh = options != 0 && get_option_boolean(L, options, "refresh", false);
+
+    auto pd = get_or_new_pd_from_lua(L);
+    function_time_data *root = pd->root.get();
+    std::string query_key = fmt::format("{}:{}:{}", by, sort, depth);
+    if (is_path && options != 0)
+    {
+        lua_getfield(L, options, "root");
+        root = find_query_root(L, lua_gettop(L), *pd->root);
+        lua_pop(L, 1);
+        fmt::format_to(std::back_inserter(query_key), ":{}", static_cast<const void *>(root));
+    }
+
+    auto &entries = pd->query_entries;
+    auto &values = pd->query_entry_values;
+    if (pd->query_key != query_key || is_refresh)
+    {
+        entries.clear();
+        values.clear();
+        // names pushed for the last snapshot, so the cache never outgrows the pages of one snapshot
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::name_cache_key());
+        if (!is_path)
+        {
+            entries.reserve(pd->source_map.size());
+            for (auto &&i : pd->source_map)
+            {
+                entries.push_back({&i.second, query_sort_key(i.second, sort_type)});
+            }
+        }
+        else if (root != nullptr)
+        {
+            std::vector<function_time_data *> stack = {root};
+            while (!stack.empty())
+            {
+                auto current = stack.back();
+                stack.pop_back();
+                for (auto &&child : current->children)
+                {
+                    entries.push_back({child.second.get(), query_sort_key(*child.second, sort_type)});
+                    if (depth == 0 || child.second->stack_depth - root->stack_depth < depth)
+                    {
+                        stack.push_back(child.second.get());
+                    }
+                }
+            }
+        }
+        pd->query_key = std::move(query_key);
+        pd->query_sorted_count = 0;
+    }
 
-// static void print_json(std::ostream &os, function_time_data_t &root)
-// {
-//     json j = json::object();
-//     std::stack<json::value_type *> parent_stack;
-//     parent_stack.push(&j);
+    size_t total_count = entries.size();
+    size_t begin = std::min(offset, total_count);
+    size_t end = top == 0 ? total_count : std::min(total_count, begin + top);
+    if (pd->query_sorted_count < end)
+    {
+        // the sorted entries are ahead of all others, only the rest is sorted up to end
+        auto sorted_end = entries.begin() + pd->query_sorted_count;
+        std::partial_sort(sorted_end, entries.begin() + end, entries.end(), [](const query_entry &l, const query_entry &r) {
+            if (l.sort_key != r.sort_key)
+            {
+                return l.sort_key > r.sort_key;
+            }
+            if (l.data->function_name != r.data->function_name)
+            {
+                return l.data->function_name < r.data->function_name;
+            }
+            return l.data->stack_depth != r.data->stack_depth ? l.data->stack_depth < r.data->stack_depth : l.data < r.data;
+        });
+        pd->query_sorted_count = end;
+    }
 
-//     traverse_tree<sort_t::total_time>(root, 0, [&](function_time_data_t &current, size_t current_stack) {
-//         size_t parent_size = current_stack + 1;
-//         json currentj = json::object();
-//         currentj["function_name"] = current->function_name;
-//         currentj["function_source"] = current->function_source;
-//         currentj["count"] = current->count;
-//         currentj["self_time"] = current->self_time.count();
-//         currentj["children_time"] = current->children_time.count();
-//         currentj["total_time"] = current->total_time.count();
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::name_cache_key()) != LUA_TTABLE)
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::name_cache_key());
+    }
+    int cache_index = lua_gettop(L);
 
-//         while (parent_stack.size() > parent_size)
-//         {
-//             parent_stack.pop();
-//         }
+    int field_count = 6;
+    field_count += pd->is_cpu_time ? 2 : 0;
+    field_count += pd->is_perf_counters ? static_cast<int>(perf_counter_count) * 2 : 0;
+    field_count += is_path ? 2 : 0;
+    lua_createtable(L, static_cast<int>(end - begin), 0);
+    for (size_t i = begin; i < end; ++i)
+    {
+        auto &entry = entries[i];
+        if (entry.values == query_entry::no_values)
+        {
+            entry.values = values.size();
+            values.emplace_back(*entry.data);
+        }
+        auto &data = values[entry.values];
+        lua_createtable(L, 0, field_count);
+        push_query_name(L, cache_index, *entry.data);
+        lua_setfield(L, -2, "name");
+        lua_pushlstring(L, entry.data->function_source.data(), entry.data->function_source.size());
+        lua_setfield(L, -2, "source");
+        lua_pushinteger(L, data.count);
+        lua_setfield(L, -2, "count");
+        lua_pushinteger(L, data.total_time.count());
+        lua_setfield(L, -2, "total");
+        lua_pushinteger(L, data.self_time.count());
+        lua_setfield(L, -2, "self");
+        lua_pushinteger(L, data.children_time.count());
+        lua_setfield(L, -2, "children");
+        if (pd->is_cpu_time)
+        {
+            lua_pushinteger(L, data.cpu_total_time.count());
+            lua_setfield(L, -2, "cpu_total");
+            lua_pushinteger(L, data.cpu_self_time.count());
+            lua_setfield(L, -2, "cpu_self");
+        }
+        if (pd->is_perf_counters)
+        {
+            for (size_t i = 0; i < perf_counter_count; ++i)
+            {
+                lua_pushinteger(L, data.perf_total.values[i]);
+                lua_setfield(L, -2, perf_counter_names[i]);
+                lua_pushinteger(L, data.perf_self.values[i]);
+                lua_setfield(L, -2, fmt::format("{}_self", perf_counter_names[i]).c_str());
+            }
+        }
+        if (is_path)
+        {
+            lua_pushinteger(L, entry.data->stack_depth - root->stack_depth);
+            lua_setfield(L, -2, "depth");
+            lua_pushinteger(L, data.child_count);
+            lua_setfield(L, -2, "child_count");
+        }
+        lua_rawseti(L, -2, static_cast<lua_Integer>(i - begin + 1));
+    }
+    lua_pushinteger(L, total_count);
+    return 2;
+}
 
-//         auto &parent_children = (*parent_stack.top())[children_key];
-//         if (parent_children.is_null())
-//         {
-//             parent_children = json::array();
-//         }
-//         parent_children.push_back(currentj);
-//         parent_stack.push(&parent_children.back());
-//     });
-//     os << j[children_key][0].dump(); // serialize from root;
-// }
-static void print_json(std::ostream &os, function_time_data_t &root)
+static int profile_report_to_file(lua_State *L)
+{
+    std::string report_type = luaL_checkstring(L, 1); // tree/list/json/pprof/frames/slow/graph
+
+    size_t max_limit = 0; // max stack for tree or max top for list, 0 means no limit
+    if (lua_gettop(L) > 1 && lua_isinteger(L, 2))
+    {
+        max_limit = std::abs(lua_tointeger(L, 2));
+    }
+
+    std::string file_name;
+    if (report_type == "tree")
+    {
+        auto pd = get_or_new_pd_from_lua(L);
+        file_name = fmt::format("{}.lua_profile_tree.txt", record_clock_t::now().time_since_epoch().count());
+        std::ofstream os(file_name);
+        auto max_function_name_length = pd->get_max_function_name_length(max_limit);
+        print_tree(os, *pd->root, max_function_name_length + space_after_name, max_limit, get_report_thread_count(pd->node_count), pd->get_report_columns());
+    }
+    else if (report_type == "list")
+    {
+        auto pd = get_or_new_pd_from_lua(L);
+        file_name = fmt::format("{}.lua_profile_list.txt", record_clock_t::now().time_since_epoch().count());
+        std::ofstream os(file_name);
+        print_list(os, *pd, max_limit, get_report_thread_count(pd->source_map.size()));
+    }
+    else if (report_type == "json")
+    {
+        auto pd = get_or_new_pd_from_lua(L);
+        file_name = fmt::format("{}.lua_profile_json.txt", record_clock_t::now().time_since_epoch().count());
+        std::ofstream os(file_name);
+        print_json(os, *pd->root, pd->get_report_columns());
+    }
+    else if (report_type == "pprof")
+    {
+        auto pd = get_or_new_pd_from_lua(L);
+        file_name = fmt::format("{}.lua_profile.{}", record_clock_t::now().time_since_epoch().count(), pprof_file::extension());
+        pprof_file file(file_name);
+        write_pprof(file, *pd->root, pd->get_report_columns());
+    }
+    else if (report_type == "slow")
+    {
+        auto pd = get_or_new_pd_from_lua(L);
+        file_name = fmt::format("{}.lua_profile_slow.txt", record_clock_t::now().time_since_epoch().count());
+        std::ofstream os(file_name);
+        for (auto &&trace : pd->flight.traces)
+        {
+            os << format_flight_trace(*trace);
+        }
+    }
+    else if (report_type == "frames")
+    {
+        auto pd = get_or_new_pd_from_lua(L);
+        file_name = fmt::format("{}.lua_profile_frames.txt", record_clock_t::now().time_since_epoch().count());
+        std::ofstream os(file_name);
+        print_frames(os, *pd, max_limit);
+    }
+    else if (report_type == "graph")
+    {
+        auto pd = get_or_new_pd_from_lua(L);
+        file_name = fmt::format("{}.lua_profile_graph.txt", record_clock_t::now().time_since_epoch().count());
+        std::ofstream os(file_name);
+        print_graph(os, pd->graph, *pd->root, max_limit);
+    }
+
+    if (file_name.empty())
+    {
+        return 0;
+    }
+    lua_pushstring(L, file_name.c_str());
+    return 1;
+}
+
+static int profile_report_frames(lua_State *L)
+{
+    size_t max_top = 0;
+    if (lua_gettop(L) > 0 && lua_isinteger(L, 1))
+    {
+        max_top = std::abs(lua_tointeger(L, 1));
+    }
+
+    auto pd = get_or_new_pd_from_lua(L);
+    std::ostringstream os;
+    print_frames(os, *pd, max_top);
+    lua_pushstring(L, os.str().c_str());
+    return 1;
+}
+
+static int profile_report_info(lua_State *L)
+{
+    auto pd = get_or_new_pd_from_lua(L);
+    std::ostringstream os;
+    os << fmt::format(" main_stack_size:{}",
+                      pd->main_thread_stack.size());
+    os << std::endl;
+    if (auto &adaptive = pd->adaptive; adaptive.is_enabled || adaptive.sample_count > 0)
+    {
+        // sampling phase cost is the sampling hook time, precise phase cost grows with the events
+        auto end_time = adaptive.is_enabled ? record_clock_t::now() : adaptive.stop_time;
+        bool is_precise_reached = adaptive.precise_begin_time.time_since_epoch().count() != 0;
+        auto sampling_end_time = is_precise_reached ? adaptive.precise_begin_time : end_time;
+        size_t hot_count = std::count_if(adaptive.hot_functions.begin(), adaptive.hot_functions.end(), [](auto &&i) {
+            return i.second == adaptive_profile::function_hot;
+        });
+        os << fmt::format(" adaptive phase:{} sampling_phase:{} precise_phase:{} samples:{} sample_hook_time:{} ranks:{} hot:{} coverage:{:.1f}% accepted_events:{} rejected_events:{}",
+                          !adaptive.is_enabled ? "stopped" : (adaptive.is_precise ? "precise" : "sampling"),
+                          (sampling_end_time - adaptive.start_time).count(),
+                          is_precise_reached ? (end_time - adaptive.precise_begin_time).count() : 0,
+                          adaptive.sample_count,
+                          adaptive.sample_hook_time.count(),
+                          adaptive.rank_count,
+                          hot_count,
+                          adaptive.coverage * 100,
+                          adaptive.accepted_events,
+                          adaptive.rejected_events);
+        os << std::endl;
+    }
+    if (pd->graph.is_enabled || !pd->graph.edges.empty())
+    {
+        os << fmt::format(" graph functions:{} edges:{}", pd->graph.functions.size() - 1, pd->graph.edges.size());
+        os << std::endl;
+    }
+    if (pd->is_perf_counters || !pd->perf_counters_error.empty())
+    {
+        auto &counters = perf_counters::current();
+        os << " perf_counters:";
+        for (size_t i = 0; i < perf_counter_count; ++i)
+        {
+            os << fmt::format(" {}:{}", perf_counter_names[i], counters.is_counting(i) ? "on" : "off");
+        }
+        os << " by:" << counters.get_read_method();
+        if (!pd->perf_counters_error.empty())
+        {
+            os << " error:" << pd->perf_counters_error;
+        }
+        os << std::endl;
+    }
+    lua_pushstring(L, os.str().c_str());
+    return 1;
+}
+
+static int profile_report_threads(lua_State *L)
+{
+    if (lua_gettop(L) > 0 && lua_isinteger(L, 1))
+    {
+        report_thread_count = std::abs(lua_tointeger(L, 1));
+    }
+    lua_pushinteger(L, report_thread_count);
+    return 1;
+}
+
+// lua 5.3 coroutine.create, resume and wrap, their closures keep the profile_data userdata as
+// upvalue so a resume does not look it up, wrap keeps the thread before it
+static const int coroutine_pd_upvalue = 1;
+
+static profile_data *get_pd_of_coroutine_function(lua_State *L, int pd_index)
+{
+    return static_cast<profile_data_userdata *>(lua_touserdata(L, pd_index))->pd.get();
+}
+
+// the hook switches between the resumer and the coroutine until the yield, both are looked up now
+// on the stack of the running resumer
+static coroutine_stack_userdata *on_coroutine_resuming(lua_State *L, profile_data &pd, int thread_index, int pd_index)
+{
+    if (pd.last_thread_of_hook == L && pd.last_coroutine_of_hook != nullptr)
+    {
+        pd.remember_coroutine(L, pd.last_coroutine_of_hook);
+    }
+    auto ud = pd.find_coroutine(L, thread_index, pd_index);
+    if (ud != nullptr)
+    {
+        pd.remember_coroutine(ud->thread, ud);
+    }
+    return ud;
+}
+
+// tells the hook whether the coroutine is dead so a coroutine switch does not have to probe the thread,
+// ud is nullptr when the coroutine had not run before, its first hook event created it
+static void on_coroutine_resumed(lua_State *L, profile_data &pd, coroutine_stack_userdata *ud, int thread_index, int pd_index, int status)
+{
+    if (ud == nullptr)
+    {
+        ud = pd.find_coroutine(L, thread_index, pd_index);
+    }
+    if (ud != nullptr)
+    {
+        ud->is_resume_status_known = true;
+        ud->is_dead = (status != LUA_YIELD);
+    }
+}
+
+// a coroutine is targeted if its body or a function on the creating stack is a target
+static bool is_coroutine_target(lua_State *L, profile_data &pd, int body_index)
+{
+    if (pd.coroutine_target_functions.empty())
+    {
+        return false;
+    }
+    if (pd.coroutine_target_functions.count(lua_topointer(L, body_index)) > 0)
+    {
+        return true;
+    }
+    lua_Debug ar;
+    for (int level = 1; lua_getstack(L, level, &ar); ++level)
+    {
+        lua_getinfo(L, "f", &ar);
+        bool is_target = pd.coroutine_target_functions.count(lua_topointer(L, -1)) > 0;
+        lua_pop(L, 1);
+        if (is_target)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// keys the thread at index in the weak coroutine table so stop() unhooks it even if it never ran,
+// its stack userdata replaces the true value at its first hook event
+static void track_hooked_thread(lua_State *L, int thread_index)
+{
+    thread_index = lua_absindex(L, thread_index);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+    lua_getuservalue(L, -1);
+    lua_pushvalue(L, thread_index);
+    if (lua_rawget(L, -2) == LUA_TNIL)
+    {
+        lua_pushvalue(L, thread_index);
+        lua_pushboolean(L, true);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 3);
+}
+
+// new threads inherit the hook of their creator, with targeting only targets keep it,
+// the new thread is on top of the stack of L
+static void on_coroutine_created(lua_State *L, lua_State *co, int body_index)
+{
+    auto pd = get_pd_of_coroutine_function(L, lua_upvalueindex(coroutine_pd_upvalue));
+    if (pd->hook == nullptr)
+    {
+        return;
+    }
+    if (!pd->is_coroutine_targeted || is_coroutine_target(L, *pd, body_index))
+    {
+        pd->set_thread_hook(co);
+        track_hooked_thread(L, -1);
+    }
+    else
+    {
+        lua_sethook(co, nullptr, 0, 0);
+    }
+}
+
+static int coroutine_aux_resume(lua_State *L, lua_State *co, int narg, int thread_index, int pd_index)
+{
+    if (!lua_checkstack(co, narg))
+    {
+        lua_pushliteral(L, "too many arguments to resume");
+        return -1; // error flag
+    }
+    if (lua_status(co) == LUA_OK && lua_gettop(co) == 0)
+    {
+        lua_pushliteral(L, "cannot resume dead coroutine");
+        return -1; // error flag
+    }
+    auto pd = get_pd_of_coroutine_function(L, pd_index);
+    bool is_hooked = pd->hook != nullptr; // stopped or cleared, a closure kept by the caller
+    auto ud = is_hooked ? on_coroutine_resuming(L, *pd, thread_index, pd_index) : nullptr;
+    lua_xmove(L, co, narg);
+    int status = lua_resume(co, L, narg);
+    if (is_hooked)
+    {
+        on_coroutine_resumed(L, *pd, ud, thread_index, pd_index, status);
+    }
+    if (status == LUA_OK || status == LUA_YIELD)
+    {
+        int nres = lua_gettop(co);
+        if (!lua_checkstack(L, nres + 1))
+        {
+            lua_pop(co, nres); // remove results anyway
+            lua_pushliteral(L, "too many results to resume");
+            return -1; // error flag
+        }
+        lua_xmove(co, L, nres); // move yielded values
+        return nres;
+    }
+    else
+    {
+        lua_xmove(co, L, 1); // move error message
+        return -1;           // error flag
+    }
+}
+
+static int coroutine_resume(lua_State *L)
+{
+    lua_State *co = lua_tothread(L, 1);
+    luaL_argcheck(L, co, 1, "coroutine expected");
+    int r = coroutine_aux_resume(L, co, lua_gettop(L) - 1, 1, lua_upvalueindex(coroutine_pd_upvalue));
+    if (r < 0)
+    {
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 2; // return false + error message
+    }
+    else
+    {
+        lua_pushboolean(L, 1);
+        lua_insert(L, -(r + 1));
+        return r + 1; // return true + 'resume' returns
+    }
+}
+
+static int coroutine_aux_wrap(lua_State *L)
+{
+    lua_State *co = lua_tothread(L, lua_upvalueindex(1));
+    int r = coroutine_aux_resume(L, co, lua_gettop(L), lua_upvalueindex(1), lua_upvalueindex(1 + coroutine_pd_upvalue));
+    if (r < 0)
+    {
+        if (lua_type(L, -1) == LUA_TSTRING) // error object is a string?
+        {
+            luaL_where(L, 1); // get extra info
+            lua_insert(L, -2);
+            lua_concat(L, 2);
+        }
+        return lua_error(L); // propagate error
+    }
+    return r;
+}
+
+static int coroutine_create(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_State *co = lua_newthread(L);
+    lua_pushvalue(L, 1); // move function to top
+    lua_xmove(L, co, 1); // move function from L to co
+    on_coroutine_created(L, co, 1);
+    return 1;
+}
+
+static int coroutine_wrap(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_State *co = lua_newthread(L);
+    lua_pushvalue(L, 1); // move function to top
+    lua_xmove(L, co, 1); // move function from L to co
+    on_coroutine_created(L, co, 1);
+    lua_pushvalue(L, lua_upvalueindex(coroutine_pd_upvalue));
+    lua_pushcclosure(L, coroutine_aux_wrap, 2);
+    return 1;
+}
+
+static const luaL_Reg coroutine_replacements[] = {{"create", coroutine_create},
+                                                   {"resume", coroutine_resume},
+                                                   {"wrap", coroutine_wrap}};
+
+// registry key of the table keeping the replaced functions while the replacements are installed
+static const void *coroutine_originals_key()
+{
+    static char c;
+    return &c;
+}
+
+static void intercept_coroutine_library(lua_State *L)
+{
+    auto top = lua_gettop(L);
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+    if (lua_getfield(L, -1, "coroutine") == LUA_TTABLE && lua_rawgetp(L, LUA_REGISTRYINDEX, coroutine_originals_key()) == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 3);
+        for (auto &&replacement : coroutine_replacements)
+        {
+            lua_getfield(L, -2, replacement.name);
+            lua_setfield(L, -2, replacement.name);
+            lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+            lua_pushcclosure(L, replacement.func, 1);
+            lua_setfield(L, -3, replacement.name);
+        }
+        lua_rawsetp(L, LUA_REGISTRYINDEX, coroutine_originals_key());
+    }
+    lua_settop(L, top);
+}
+
+// puts the originals back, functions replaced again by someone else since are left alone
+static void restore_coroutine_library(lua_State *L)
+{
+    auto top = lua_gettop(L);
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, coroutine_originals_key()) == LUA_TTABLE)
+    {
+        luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+        if (lua_getfield(L, -1, "coroutine") == LUA_TTABLE)
+        {
+            for (auto &&replacement : coroutine_replacements)
+            {
+                lua_getfield(L, -1, replacement.name);
+                bool is_replaced = lua_tocfunction(L, -1) == replacement.func;
+                lua_pop(L, 1);
+                if (is_replaced)
+                {
+                    lua_getfield(L, top + 1, replacement.name);
+                    lua_setfield(L, -2, replacement.name);
+                }
+            }
+        }
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, coroutine_originals_key());
+    }
+    lua_settop(L, top);
+}
+
+// start{coroutines = "all"|"none"|{thread or function, ...}}, every start without it is "all"
+static void set_coroutine_targets(lua_State *L, profile_data &pd, bool is_coroutine)
 {
-    using namespace rapidjson;
-    using jvar = Document::ValueType;
-    using json = Document;
-    json j(kObjectType);
-    auto &a = j.GetAllocator();
-    std::stack<jvar *> parent_stack;
-    parent_stack.push(&j);
+    pd.is_coroutine_targeted = false;
+    pd.coroutine_target_functions.clear();
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::coroutine_targets_key());
+    if (!lua_istable(L, 1) || !is_coroutine)
+    {
+        return;
+    }
+    lua_getfield(L, 1, "coroutines");
+    if (lua_isstring(L, -1))
+    {
+        pd.is_coroutine_targeted = std::strcmp(lua_tostring(L, -1), "all") != 0;
+    }
+    else if (lua_istable(L, -1))
+    {
+        pd.is_coroutine_targeted = true;
+        lua_newtable(L); // anchors of the target functions
+        lua_pushnil(L);
+        while (lua_next(L, -3) != 0)
+        {
+            if (lua_isthread(L, -1))
+            {
+                pd.set_thread_hook(lua_tothread(L, -1));
+                track_hooked_thread(L, -1);
+            }
+            else if (lua_isfunction(L, -1))
+            {
+                pd.coroutine_target_functions.insert(lua_topointer(L, -1));
+                lua_pushvalue(L, -1);
+                lua_pushboolean(L, true);
+                lua_rawset(L, -5);
+            }
+            lua_pop(L, 1);
+        }
+        lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::coroutine_targets_key());
+    }
+    lua_pop(L, 1);
+}
 
-    traverse_tree<sort_t::total_time>(root, 0, [&](function_time_data_t &current, size_t current_stack) {
-        size_t parent_size = current_stack + 1;
-        jvar currentj(kObjectType);
-        currentj.AddMember("function_name", jvar(current->function_name.c_str(), a), a);
-        currentj.AddMember("function_source", jvar(current->function_source.c_str(), a), a);
-        currentj.AddMember("count", jvar(current->count), a);
-        currentj.AddMember("self_time", current->self_time.count(), a);
-        currentj.AddMember("children_time", current->children_time.count(), a);
-        currentj.AddMember("total_time", current->total_time.count(), a);
+// start{adaptive = true, hot = 20, sample_interval = 1000 (instructions), sample_time = 200 (ms), rerank = 2000 (ms)}
+static void set_adaptive_options(lua_State *L, profile_data &pd)
+{
+    auto &adaptive = pd.adaptive;
+    auto get_number = [&](const char *name, double default_value) {
+        lua_getfield(L, 1, name);
+        double value = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : default_value;
+        lua_pop(L, 1);
+        return value;
+    };
+    adaptive.hot_count = static_cast<size_t>(std::max(get_number("hot", 20), 1.0));
+    adaptive.sample_interval = static_cast<int>(std::max(get_number("sample_interval", 1000), 1.0));
+    adaptive.sample_time = duration_cast<time_unit_t>(duration<double, std::milli>(get_number("sample_time", 200)));
+    adaptive.rerank_time = duration_cast<time_unit_t>(duration<double, std::milli>(get_number("rerank", 2000)));
+    adaptive.is_enabled = true;
+    adaptive.precise_hook = pd.hook;
+    adaptive.start_time = record_clock_t::now();
+    if (!adaptive.is_precise)
+    {
+        adaptive.precise_begin_time = {};
+    }
+    adaptive.next_rank_time = adaptive.start_time + adaptive.sample_time;
+    pd.hook_count = adaptive.sample_interval;
+    if (adaptive.is_precise)
+    {
+        pd.hook_mask = LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT;
+    }
+    else
+    {
+        pd.hook = adaptive_sample_hooker;
+        pd.hook_mask = LUA_MASKCOUNT;
+    }
+}
 
-        while (parent_stack.size() > parent_size)
+// profiler.start{coroutine=true, tail_call=true, compensation=true, name=true, clock="default"|"coarse", cpu_time=false, perf_counters=false, graph=false, coroutines="all"}
+static int profile_start(lua_State *L)
+{
+    size_t feature_bits = 0;
+    if (lua_istable(L, 1))
+    {
+        feature_bits |= get_option_boolean(L, 1, "coroutine", true) ? 0 : size_t(hook_no_coroutine);
+        feature_bits |= get_option_boolean(L, 1, "tail_call", true) ? 0 : size_t(hook_no_tail_call);
+        feature_bits |= get_option_boolean(L, 1, "compensation", true) ? 0 : size_t(hook_no_compensation);
+        feature_bits |= get_option_boolean(L, 1, "name", true) ? 0 : size_t(hook_no_name);
+        feature_bits |= get_option_boolean(L, 1, "cpu_time", false) ? size_t(hook_cpu_time) : 0;
+        feature_bits |= get_option_boolean(L, 1, "adaptive", false) ? size_t(hook_adaptive) : 0;
+        feature_bits |= get_option_boolean(L, 1, "perf_counters", false) ? size_t(hook_perf_counters) : 0;
+        lua_getfield(L, 1, "clock");
+        if (lua_isstring(L, -1) && std::strcmp(lua_tostring(L, -1), "coarse") == 0)
         {
-            parent_stack.pop();
+            feature_bits |= hook_coarse_clock;
         }
-        auto &parent = *parent_stack.top();
-        auto parent_children_itr = parent.FindMember(children_key.c_str());
-        jvar *parent_children = nullptr;
-        if (parent_children_itr == parent.MemberEnd())
+        lua_pop(L, 1);
+    }
+    // times of both clocks do not add up, they count from different epochs
+    bool is_coarse_clock = (feature_bits & hook_coarse_clock) != 0;
+    if (auto pd = get_or_new_pd_from_lua(L); pd->node_count > 1 && pd->is_coarse_clock != is_coarse_clock)
+    {
+        return luaL_error(L, "profile recorded with clock %s, clear() it before starting with clock %s",
+                          pd->is_coarse_clock ? "coarse" : "default", is_coarse_clock ? "coarse" : "default");
+    }
+    // the call tree and the flattened nodes of graph mode do not mix under root
+    bool is_graph = lua_istable(L, 1) && get_option_boolean(L, 1, "graph", false);
+    if (auto pd = get_or_new_pd_from_lua(L); pd->node_count > 1 && pd->graph.is_enabled != is_graph)
+    {
+        return luaL_error(L, "profile recorded %s, clear() it before starting %s",
+                          pd->graph.is_enabled ? "in graph mode" : "as a tree", is_graph ? "in graph mode" : "as a tree");
+    }
+    bool is_coroutine = (feature_bits & hook_no_coroutine) == 0;
+    if (is_coroutine)
+    {
+        intercept_coroutine_library(L);
+    }
+    if ((feature_bits & hook_cpu_time) != 0)
+    {
+        get_or_new_pd_from_lua(L)->is_cpu_time = true;
+    }
+    if ((feature_bits & hook_perf_counters) != 0)
+    {
+        // without counters the profile goes on as if they were not asked for, report_info tells why
+        auto pd = get_or_new_pd_from_lua(L);
+        pd->perf_counters_error.clear();
+        if (perf_counters::current().open(pd->perf_counters_error))
         {
-            jvar children_array(kArrayType);
-            parent.AddMember(jvar(children_key.c_str(), a), children_array, a);
-            parent_children = &(parent[jvar(children_key.c_str(), a)]);
+            pd->is_perf_counters = true;
         }
         else
         {
-            parent_children = &parent_children_itr->value;
+            feature_bits &= ~hook_perf_counters;
         }
-        parent_children->PushBack(currentj, a);
-        parent_stack.push(&((*parent_children)[parent_children->Size() - 1]));
-    });
-    StringBuffer buffer;
-    Writer<StringBuffer> writer(buffer);
-    j[jvar(children_key.c_str(), a)][0].Accept(writer); // serialize from root;
-    os << buffer.GetString();
+    }
+    auto pd = get_or_new_pd_from_lua(L);
+    pd->is_coarse_clock = is_coarse_clock;
+    pd->live.next_publish_time = {}; // the clock may have changed
+    pd->graph.is_enabled = is_graph;
+    pd->hook = profile_hookers[feature_bits];
+    pd->hook_mask = LUA_MASKCALL | LUA_MASKRET;
+    pd->hook_count = 0;
+    if ((feature_bits & hook_adaptive) != 0)
+    {
+        set_adaptive_options(L, *pd);
+    }
+    else
+    {
+        pd->adaptive.stop(record_clock_t::now());
+    }
+    set_coroutine_targets(L, *pd, is_coroutine);
+    pd->set_thread_hook(L);
+    return 0;
 }
 
-static int profile_report_tree(lua_State *L)
+static int profile_stop(lua_State *L)
 {
-    size_t max_stack = 0;
-    if (lua_gettop(L) > 0 && lua_isinteger(L, 1))
+    lua_sethook(L, nullptr, 0, 0);
+    auto pd = get_or_new_pd_from_lua(L);
+    pd->hook = nullptr;
+    pd->adaptive.stop(record_clock_t::now());
+    lua_sethook(pd->main_thread, nullptr, 0, 0);
+    // every coroutine hooked by the profiler, keys of the weak table,
+    // threads it does not know about unhook themselves at their next event
+    lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+    lua_getuservalue(L, -1);
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0)
     {
-        max_stack = std::abs(lua_tointeger(L, 1));
+        lua_sethook(lua_tothread(L, -2), nullptr, 0, 0);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    restore_coroutine_library(L);
+    // a slow call still waiting for its following events is captured with what is there
+    if (pd->flight.is_pending)
+    {
+        pd->flight.freeze();
+    }
+    if (pd->live.is_enabled)
+    {
+        publish_live_export(*pd, {});
     }
+    return 0;
+}
 
+// profiler.attach(co) profiles a coroutine created before start or not targeted, returns false if not started
+static int profile_attach(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTHREAD);
     auto pd = get_or_new_pd_from_lua(L);
-    pd->calculate_root_time(max_stack);
-    std::ostringstream os;
-    auto max_function_name_length = pd->get_max_function_name_length(max_stack);
-    print_tree(os, pd->root, max_function_name_length + space_after_name, max_stack);
-    lua_pushstring(L, os.str().c_str());
+    if (pd->hook != nullptr)
+    {
+        pd->set_thread_hook(lua_tothread(L, 1));
+        track_hooked_thread(L, 1);
+    }
+    lua_pushboolean(L, pd->hook != nullptr);
     return 1;
 }
 
-static int profile_report_list(lua_State *L)
+// profiler.detach(co) removes the hook of a coroutine and closes its running calls
+static int profile_detach(lua_State *L)
 {
-    size_t max_top = 0;
-    if (lua_gettop(L) > 0 && lua_isinteger(L, 1))
+    luaL_checktype(L, 1, LUA_TTHREAD);
+    auto co = lua_tothread(L, 1);
+    lua_sethook(co, nullptr, 0, 0);
+    auto pd = get_or_new_pd_from_lua(L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+    if (auto ud = pd->find_coroutine(L, 1, -1); ud != nullptr && !ud->coroutine_stack.empty())
     {
-        max_top = std::abs(lua_tointeger(L, 1));
+        // on the clock of the hook: when it last switched out or entered its top call
+        auto &top = ud->coroutine_stack.back();
+        auto begin_time = std::max(top.last_record_time, top.call_end_time);
+        time_point_t cpu_begin_time = {};
+        perf_counter_values perf_begin;
+        if (pd->is_cpu_time)
+        {
+            auto &cpu_top = ud->coroutine_stack.cpu_time_back();
+            cpu_begin_time = std::max(cpu_top.last_record, cpu_top.call_end);
+        }
+        if (pd->is_perf_counters)
+        {
+            auto &perf_top = ud->coroutine_stack.perf_counters_back();
+            perf_begin = top.last_record_time > top.call_end_time ? perf_top.last_record : perf_top.call_end;
+        }
+        ++pd->generation;
+        close_function_stack(*pd, ud->coroutine_stack, begin_time, cpu_begin_time, perf_begin);
     }
+    return 0;
+}
 
+// profiler.live_export{name = "/lua_profiler.<pid>", interval = 500 (ms)} returns the segment name,
+// profiler.live_export(false) removes the segment
+static int profile_live_export(lua_State *L)
+{
     auto pd = get_or_new_pd_from_lua(L);
-    std::ostringstream os;
-    print_list(os, pd->root, max_top);
-    lua_pushstring(L, os.str().c_str());
+    if (lua_isboolean(L, 1) && !lua_toboolean(L, 1))
+    {
+        pd->live.close();
+        return 0;
+    }
+    std::string name;
+    if (lua_istable(L, 1))
+    {
+        lua_getfield(L, 1, "name");
+        if (lua_isstring(L, -1))
+        {
+            name = lua_tostring(L, -1);
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, 1, "interval");
+        if (lua_isnumber(L, -1))
+        {
+            pd->live.interval = duration_cast<time_unit_t>(duration<double, std::milli>(lua_tonumber(L, -1)));
+        }
+        lua_pop(L, 1);
+    }
+#if !defined(_WIN32)
+    if (name.empty())
+    {
+        name = fmt::format("/lua_profiler.{}", getpid());
+    }
+#endif
+    std::string error;
+    if (!pd->live.open(name, error))
+    {
+        return luaL_error(L, "%s", error.c_str());
+    }
+    // what was recorded before the export enters the first publish
+    for (auto &&i : pd->source_map)
+    {
+        pd->live.touched.insert(&i.second);
+        pd->live.touched_functions.push_back(&i.second);
+    }
+    for (auto &&i : pd->root->children)
+    {
+        pd->live.touched.insert(i.second.get());
+        pd->live.touched_roots.push_back(i.second.get());
+    }
+    lua_pushstring(L, name.c_str());
     return 1;
 }
 
-static int profile_report_to_file(lua_State *L)
+// profiler.frame_config{budget = 50 (ms), history = 120, spikes = 16, dump = false}
+static int profile_frame_config(lua_State *L)
 {
-    std::string report_type = luaL_checkstring(L, 1); // tree/list/json
-
-    size_t max_limit = 0; // max stack for tree or max top for list, 0 means no limit
-    if (lua_gettop(L) > 1 && lua_isinteger(L, 2))
+    luaL_checktype(L, 1, LUA_TTABLE);
+    auto pd = get_or_new_pd_from_lua(L);
+    auto &frames = pd->frames;
+    lua_getfield(L, 1, "budget");
+    if (lua_isnumber(L, -1))
     {
-        max_limit = std::abs(lua_tointeger(L, 2));
+        frames.budget = duration_cast<time_unit_t>(duration<double, std::milli>(lua_tonumber(L, -1)));
     }
+    lua_pop(L, 1);
+    frames.is_dump = get_option_boolean(L, 1, "dump", frames.is_dump);
+    lua_getfield(L, 1, "history");
+    size_t history_size = lua_isinteger(L, -1) ? std::abs(lua_tointeger(L, -1)) : std::max<size_t>(frames.history.size(), 120);
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "spikes");
+    size_t spike_size = lua_isinteger(L, -1) ? std::abs(lua_tointeger(L, -1)) : (frames.history.empty() ? 16 : frames.spikes.size());
+    lua_pop(L, 1);
+    frames.configure(history_size, spike_size, 256);
+    return 0;
+}
 
-    if (report_type == "tree")
+// closes the current frame, returns its duration in nanoseconds (nothing for the first mark)
+static int profile_frame_mark(lua_State *L)
+{
+    auto now = record_clock_t::now();
+    auto pd = get_or_new_pd_from_lua(L);
+    bool is_spike = false;
+    auto frame = pd->frames.mark(*pd->root, now, is_spike);
+    if (frame == nullptr)
     {
-        auto pd = get_or_new_pd_from_lua(L);
-        pd->calculate_root_time(max_limit);
-        std::string file_name = fmt::format("{}.lua_profile_tree.txt", record_clock_t::now().time_since_epoch().count());
-        std::ofstream os(file_name);
-        auto max_function_name_length = pd->get_max_function_name_length(max_limit);
-        print_tree(os, pd->root, max_function_name_length + space_after_name, max_limit);
+        return 0;
     }
-    else if (report_type == "list")
+    if (is_spike && pd->frames.is_dump)
     {
-        auto pd = get_or_new_pd_from_lua(L);
-        std::string file_name = fmt::format("{}.lua_profile_list.txt", record_clock_t::now().time_since_epoch().count());
-        std::ofstream os(file_name);
-        print_list(os, pd->root, max_limit);
+        // the tree is only safe to read here, the file is written on the writer thread
+        std::ostringstream os;
+        os << fmt::format("frame {} duration:{}", frame->index, frame->duration.count()) << std::endl;
+        print_frame_tree(os, *pd->root, *frame, pd->get_report_columns());
+        async_file_writer::shared().write(fmt::format("{}.lua_profile_frame.txt", now.time_since_epoch().count()),
+                                          [content = os.str()]() { return content; });
     }
-    else if (report_type == "json")
+    lua_pushinteger(L, frame->duration.count());
+    return 1;
+}
+
+static std::string to_function_source(const char *key)
+{
+    // "file.lua:12" is short for the lua function defined there
+    if (std::strncmp(key, "lua:", 4) == 0 || std::strncmp(key, "c:", 2) == 0)
     {
-        auto pd = get_or_new_pd_from_lua(L);
-        pd->calculate_root_time(0);
-        std::string file_name = fmt::format("{}.lua_profile_json.txt", record_clock_t::now().time_since_epoch().count());
-        std::ofstream os(file_name);
-        print_json(os, pd->root);
+        return key;
     }
+    return fmt::format("lua:{}", key);
+}
 
+// profiler.flight_config{enabled = true, threshold = 10 (ms), thresholds = {["file.lua:12"] = 2}, window = 4096, after = 64, traces = 16, dump = true}
+static int profile_flight_config(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    auto pd = get_or_new_pd_from_lua(L);
+    auto &flight = pd->flight;
+    if (!get_option_boolean(L, 1, "enabled", true))
+    {
+        flight.disable();
+        return 0;
+    }
+    lua_getfield(L, 1, "threshold");
+    if (lua_isnumber(L, -1))
+    {
+        flight.threshold = duration_cast<time_unit_t>(duration<double, std::milli>(lua_tonumber(L, -1)));
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "thresholds");
+    if (lua_istable(L, -1))
+    {
+        flight.function_thresholds.clear();
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0)
+        {
+            if (lua_type(L, -2) == LUA_TSTRING && lua_isnumber(L, -1))
+            {
+                auto function_threshold = duration_cast<time_unit_t>(duration<double, std::milli>(lua_tonumber(L, -1)));
+                flight.function_thresholds[to_function_source(lua_tostring(L, -2))] = function_threshold;
+            }
+            lua_pop(L, 1);
+        }
+        flight.source_thresholds.clear();
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "after");
+    if (lua_isinteger(L, -1))
+    {
+        flight.after = std::abs(lua_tointeger(L, -1));
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "traces");
+    if (lua_isinteger(L, -1))
+    {
+        flight.max_traces = std::abs(lua_tointeger(L, -1));
+    }
+    lua_pop(L, 1);
+    flight.is_dump = get_option_boolean(L, 1, "dump", flight.is_dump);
+    lua_getfield(L, 1, "window");
+    size_t window_size = lua_isinteger(L, -1) ? std::abs(lua_tointeger(L, -1)) : std::max<size_t>(flight.ring.size(), 4096);
+    lua_pop(L, 1);
+    flight.tree = pd->root;
+    flight.configure(window_size);
+    flight.is_enabled = true;
     return 0;
 }
 
-static int profile_report_info(lua_State *L)
+// captured slow calls, oldest first: {{name = , duration = , threshold = , trace = }, ...}
+static int profile_slow_calls(lua_State *L)
 {
     auto pd = get_or_new_pd_from_lua(L);
-    std::ostringstream os;
-    os << fmt::format(" main_stack_size:{}",
-                      pd->main_thread_stack.size());
-    os << std::endl;
-    lua_pushstring(L, os.str().c_str());
+    auto &traces = pd->flight.traces;
+    lua_createtable(L, static_cast<int>(traces.size()), 0);
+    lua_Integer index = 0;
+    for (auto &&trace : traces)
+    {
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, trace->slow_call.node->function_name.c_str());
+        lua_setfield(L, -2, "name");
+        lua_pushinteger(L, trace->slow_call.duration.count());
+        lua_setfield(L, -2, "duration");
+        lua_pushinteger(L, trace->threshold.count());
+        lua_setfield(L, -2, "threshold");
+        auto text = format_flight_trace(*trace);
+        lua_pushlstring(L, text.data(), text.size());
+        lua_setfield(L, -2, "trace");
+        lua_rawseti(L, -2, ++index);
+    }
     return 1;
 }
 
-static int profile_start(lua_State *L)
+// function value, function_source, "file.lua:12" or a name as reported
+static uint32_t find_graph_function(lua_State *L, int index, const call_graph &graph)
 {
-    lua_sethook(L, profile_hooker, LUA_MASKCALL | LUA_MASKRET, 0);
-    return 0;
+    if (lua_isfunction(L, index))
+    {
+        lua_Debug ar;
+        lua_pushvalue(L, index);
+        lua_getinfo(L, ">S", &ar);
+        if (std::strcmp("C", ar.what) == 0)
+        {
+            return graph.find(fmt::format("c:{}", lua_topointer(L, index)), "");
+        }
+        return graph.find(fmt::format("lua:{}:{}", ar.short_src, ar.linedefined), "");
+    }
+    const char *key = luaL_checkstring(L, index);
+    return graph.find(to_function_source(key), key);
 }
 
-static int profile_stop(lua_State *L)
+static void push_graph_entry(lua_State *L, const call_graph::function_entry &function, uint64_t count, time_unit_t total_time, time_unit_t self_time)
 {
-    lua_sethook(L, nullptr, 0, 0);
-    return 0;
+    lua_createtable(L, 0, 5);
+    lua_pushlstring(L, function.function_name.data(), function.function_name.size());
+    lua_setfield(L, -2, "name");
+    lua_pushlstring(L, function.function_source.data(), function.function_source.size());
+    lua_setfield(L, -2, "source");
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, total_time.count());
+    lua_setfield(L, -2, "total");
+    lua_pushinteger(L, self_time.count());
+    lua_setfield(L, -2, "self");
+}
+
+// edges of a function by total time and the function itself, nil when it was not called in graph mode
+static int push_graph_edges(lua_State *L, bool is_callers)
+{
+    auto pd = get_or_new_pd_from_lua(L);
+    auto &graph = pd->graph;
+    auto id = find_graph_function(L, 1, graph);
+    if (id == call_graph::no_id)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    auto &function = graph.functions[id];
+    auto edge_ids = is_callers ? function.caller_edges : function.callee_edges;
+    std::stable_sort(edge_ids.begin(), edge_ids.end(), [&](uint32_t l, uint32_t r) {
+        return graph.edges[l].total_time > graph.edges[r].total_time;
+    });
+    lua_createtable(L, static_cast<int>(edge_ids.size()), 0);
+    lua_Integer index = 0;
+    for (auto &&edge_id : edge_ids)
+    {
+        auto &edge = graph.edges[edge_id];
+        push_graph_entry(L, graph.functions[is_callers ? edge.caller : edge.callee], edge.count, edge.total_time, edge.self_time);
+        lua_rawseti(L, -2, ++index);
+    }
+    push_graph_entry(L, function, function.count, id == call_graph::root_id ? pd->root->total_time : function.total_time, function.self_time);
+    return 2;
+}
+
+// profiler.callers(f) / profiler.callees(f): {{name = , source = , count = , total = , self = }, ...}, {function entry}
+static int profile_callers(lua_State *L)
+{
+    return push_graph_edges(L, true);
+}
+
+static int profile_callees(lua_State *L)
+{
+    return push_graph_edges(L, false);
 }
 
 static int profile_clear(lua_State *L)
 {
+    if (auto pd = find_pd_from_lua(L); pd != nullptr)
+    {
+        pd->hook = nullptr; // coroutine functions kept from the replacements hold it
+    }
+    restore_coroutine_library(L);
     lua_pushnil(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::reg_key());
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::name_cache_key());
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, profile_data::coroutine_targets_key());
     return 0;
 }
 
@@ -932,11 +4769,94 @@ static int new_lib_profiler(lua_State *L)
                             {"report_list", profile_report_list},
                             {"report_to_file", profile_report_to_file},
                             {"report_info", profile_report_info},
+                            {"report_threads", profile_report_threads},
+                            {"report_frames", profile_report_frames},
+                            {"frame_mark", profile_frame_mark},
+                            {"frame_config", profile_frame_config},
+                            {"flight_config", profile_flight_config},
+                            {"slow_calls", profile_slow_calls},
+                            {"live_export", profile_live_export},
+                            {"attach", profile_attach},
+                            {"query", profile_query},
+                            {"detach", profile_detach},
+                            {"callers", profile_callers},
+                            {"callees", profile_callees},
                             {nullptr, nullptr}};
     luaL_setfuncs(L, lib_funcs, 0);
     return 1;
 }
 
+std::shared_ptr<profile_data> new_synthetic_profile(size_t node_count, size_t function_count, size_t max_children)
+{
+    auto pd = std::make_shared<profile_data>();
+    std::mt19937_64 random(20190514);
+    std::vector<function_time_data *> open_nodes = {pd->root.get()};
+    size_t open_index = 0;
+    while (pd->node_count < node_count && open_index < open_nodes.size())
+    {
+        auto &parent = *open_nodes[open_index++];
+        size_t children_count = 1 + random() % max_children;
+        for (size_t i = 0; i < children_count && pd->node_count < node_count; ++i)
+        {
+            size_t function_id = random() % function_count;
+            std::string function_name = fmt::format("f{}:bench.lua:{}", function_id, function_id);
+            if (parent.children.count(function_name) > 0)
+            {
+                continue;
+            }
+            auto child = pd->new_child(parent, function_name, fmt::format("lua:bench.lua:{}", function_id));
+            child->count = 1 + random() % 100;
+            child->self_time = time_unit_t(random() % 1000000);
+            open_nodes.push_back(child.get());
+        }
+    }
+
+    // roll up inclusive time bottom up, open_nodes is in breadth first order
+    for (auto itr = open_nodes.rbegin(); itr != open_nodes.rend(); ++itr)
+    {
+        auto &node = **itr;
+        node.total_time = node.self_time + node.children_time;
+        if (node.parent != nullptr)
+        {
+            node.parent->children_time += node.total_time;
+        }
+        if (node.source_data != nullptr)
+        {
+            node.source_data->count += node.count;
+            node.source_data->self_time += node.self_time;
+            node.source_data->children_time += node.children_time;
+            node.source_data->total_time += node.total_time;
+        }
+    }
+    return pd;
+}
+
+size_t get_profile_node_count(const profile_data &pd)
+{
+    return pd.node_count;
+}
+
+size_t get_profile_function_count(const profile_data &pd)
+{
+    return pd.source_map.size();
+}
+
+void print_profile_tree(std::ostream &os, profile_data &pd, size_t thread_count)
+{
+    print_tree(os, *pd.root, pd.get_max_function_name_length(0) + space_after_name, 0, thread_count, pd.get_report_columns());
+}
+
+void print_profile_list(std::ostream &os, profile_data &pd, size_t thread_count)
+{
+    pd.sorted_source_data.clear(); // drop the cached list order so it is sorted again
+    print_list(os, pd, 0, thread_count);
+}
+
+void print_profile_json(std::ostream &os, profile_data &pd)
+{
+    print_json(os, *pd.root, pd.get_report_columns());
+}
+
 int luaopen_profiler(lua_State *L)
 {
     luaL_requiref(L, "profiler", new_lib_profiler, 0);
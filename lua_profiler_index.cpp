@@ -0,0 +1,100 @@
+// lua_profiler_index build <dump> [index]
+//   indexes a *.lua_profile_json.txt dump, to <dump without _json.txt>_index by default
+// lua_profiler_index subtree <index> <node id> [depth] [max children]
+//   the node (0 is root) and its children down to depth levels (1 by default)
+// lua_profiler_index top <index> [total|self|count] [top] [offset]
+//   functions rolled up by source
+// lua_profiler_index search <index> <text> [top]
+//   functions whose name contains text, with the paths of their heaviest nodes
+// queries print one json document on stdout
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "lua_profiler_index.h"
+
+using namespace std::chrono;
+
+static std::string default_index_file_name(const std::string &dump_file_name)
+{
+    static const std::string dump_suffix = "_json.txt";
+    if (dump_file_name.size() > dump_suffix.size() && dump_file_name.compare(dump_file_name.size() - dump_suffix.size(), dump_suffix.size(), dump_suffix) == 0)
+    {
+        return dump_file_name.substr(0, dump_file_name.size() - dump_suffix.size()) + "_index";
+    }
+    return dump_file_name + ".lua_profile_index";
+}
+
+static int print_usage()
+{
+    std::cout << "usage: lua_profiler_index build <dump> [index]\n"
+                 "       lua_profiler_index subtree <index> <node id> [depth] [max children]\n"
+                 "       lua_profiler_index top <index> [total|self|count] [top] [offset]\n"
+                 "       lua_profiler_index search <index> <text> [top]"
+              << std::endl;
+    return 1;
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 3)
+    {
+        return print_usage();
+    }
+    std::string command = argv[1];
+    std::string error;
+    if (command == "build")
+    {
+        std::string index_file_name = argc > 3 ? argv[3] : default_index_file_name(argv[2]);
+        auto begin = steady_clock::now();
+        if (!build_profile_index(argv[2], index_file_name, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        std::cerr << fmt::format("{} built in {} ms", index_file_name, duration_cast<milliseconds>(steady_clock::now() - begin).count()) << std::endl;
+        return 0;
+    }
+
+    profile_index_reader reader;
+    if (!reader.open(argv[2], error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    rapidjson::StringBuffer buffer;
+    profile_index_writer writer(buffer);
+    if (command == "subtree" && argc > 3)
+    {
+        auto id = std::strtoull(argv[3], nullptr, 10);
+        if (id >= reader.header.node_count)
+        {
+            std::cerr << fmt::format("node {} out of {}", id, reader.header.node_count) << std::endl;
+            return 1;
+        }
+        size_t depth = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 1;
+        size_t max_children = argc > 5 ? std::strtoull(argv[5], nullptr, 10) : 0;
+        write_index_subtree(writer, reader, static_cast<uint32_t>(id), depth, max_children);
+    }
+    else if (command == "top")
+    {
+        std::string sort = argc > 3 ? argv[3] : "total";
+        size_t top = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 20;
+        size_t offset = argc > 5 ? std::strtoull(argv[5], nullptr, 10) : 0;
+        if (!write_index_top(writer, reader, sort, top, offset))
+        {
+            return print_usage();
+        }
+    }
+    else if (command == "search" && argc > 3)
+    {
+        size_t top = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 20;
+        write_index_search(writer, reader, argv[3], top);
+    }
+    else
+    {
+        return print_usage();
+    }
+    std::cout.write(buffer.GetString(), buffer.GetSize());
+    std::cout << std::endl;
+    return 0;
+}
@@ -0,0 +1,722 @@
+#pragma once
+// indexed profile built once from a *.lua_profile_json.txt dump by `lua_profiler_index build`,
+// records have fixed sizes so queries read the nodes they need at their offsets instead of
+// loading the dump, both sides must be built from the same version
+#include <rapidjson/error/en.h>
+#include <rapidjson/filereadstream.h>
+#include <rapidjson/reader.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <fmt/format.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static constexpr uint32_t profile_index_magic = 0x4c504958; // "LPIX"
+static constexpr uint32_t profile_index_version = 2;
+static constexpr uint32_t profile_index_no_id = UINT32_MAX;
+static constexpr uint32_t profile_index_cpu_time = 1;      // header flag, the dump has cpu_* times
+static constexpr uint32_t profile_index_perf_counters = 2; // header flag, the dump has <counter>_total/_self
+static constexpr size_t profile_index_search_nodes = 8; // nodes listed per function found by search
+
+// the counter columns of a dump written with perf_counters = true, in the order of the profiler
+static constexpr size_t profile_index_counter_count = 4;
+static const char *const profile_index_counter_names[profile_index_counter_count] = {"instructions", "cycles", "cache_misses", "branch_misses"};
+
+// times in nanoseconds, cpu times and counters are 0 unless the dump has them
+struct profile_index_times
+{
+    int64_t total_time;
+    int64_t self_time;
+    int64_t children_time;
+    int64_t cpu_total_time;
+    int64_t cpu_self_time;
+    int64_t cpu_children_time;
+    int64_t perf_total[profile_index_counter_count];
+    int64_t perf_self[profile_index_counter_count];
+};
+
+// node ids are in dump order, which is depth first: the subtree of a node is [id, subtree_end)
+// and its first child is id + 1
+struct profile_index_node
+{
+    uint32_t name;   // string id
+    uint32_t source; // string id
+    uint32_t function;
+    uint32_t parent;
+    uint32_t subtree_end;
+    uint32_t child_count;
+    uint64_t count;
+    profile_index_times times;
+};
+
+// nodes rolled up by function_source, like the function list of the viewer
+struct profile_index_function
+{
+    uint32_t name;
+    uint32_t source;
+    uint32_t first_node; // in the function nodes section, nodes of a function are by total time
+    uint32_t node_count;
+    uint64_t count;
+    profile_index_times times;
+};
+
+struct profile_index_string
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct profile_index_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t node_count;
+    uint64_t function_count;
+    uint64_t string_count;
+    uint64_t nodes_offset;          // profile_index_node[node_count]
+    uint64_t functions_offset;      // profile_index_function[function_count]
+    uint64_t function_nodes_offset; // uint32_t[node_count] node ids grouped by function
+    uint64_t by_total_offset;       // uint32_t[function_count] function ids, top first
+    uint64_t by_self_offset;
+    uint64_t by_count_offset;
+    uint64_t search_names_offset; // function names in by_total order, '\0' terminated
+    uint64_t search_names_size;
+    uint64_t strings_offset; // profile_index_string[string_count]
+    uint64_t string_data_offset;
+    uint64_t string_data_size;
+};
+
+// sax handler collecting the nodes of a dump, fields may come in any order, arrays other than
+// children and object values are skipped with everything in them
+class profile_index_builder : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, profile_index_builder>
+{
+public:
+    std::vector<profile_index_node> nodes;
+    std::vector<std::string> strings;
+    uint32_t flags = 0;
+
+    profile_index_builder()
+    {
+        intern(""); // string 0, the source of root and coroutine nodes
+    }
+
+    bool StartObject()
+    {
+        if (skip_depth > 0 || (!open_nodes.empty() && !is_in_children))
+        {
+            ++skip_depth;
+            return true;
+        }
+        uint32_t parent = open_nodes.empty() ? profile_index_no_id : open_nodes.back();
+        if (parent != profile_index_no_id)
+        {
+            ++nodes[parent].child_count;
+        }
+        else if (!nodes.empty())
+        {
+            return false; // one tree per dump
+        }
+        profile_index_node node = {};
+        node.parent = parent;
+        node.function = profile_index_no_id;
+        open_nodes.push_back(static_cast<uint32_t>(nodes.size()));
+        nodes.push_back(node);
+        is_in_children = false;
+        return true;
+    }
+
+    bool EndObject(rapidjson::SizeType)
+    {
+        if (skip_depth > 0)
+        {
+            --skip_depth;
+            return true;
+        }
+        nodes[open_nodes.back()].subtree_end = static_cast<uint32_t>(nodes.size());
+        open_nodes.pop_back();
+        is_in_children = !open_nodes.empty(); // nodes are only opened in a children array or as root
+        return true;
+    }
+
+    bool Key(const char *str, rapidjson::SizeType length, bool)
+    {
+        if (skip_depth == 0)
+        {
+            key.assign(str, length);
+        }
+        return true;
+    }
+
+    bool String(const char *str, rapidjson::SizeType length, bool)
+    {
+        if (skip_depth > 0 || is_in_children)
+        {
+            return true;
+        }
+        if (open_nodes.empty())
+        {
+            return false;
+        }
+        auto &node = nodes[open_nodes.back()];
+        if (key == "function_name")
+        {
+            node.name = intern(std::string_view(str, length));
+        }
+        else if (key == "function_source")
+        {
+            node.source = intern(std::string_view(str, length));
+        }
+        return true;
+    }
+
+    bool Int(int value) { return number(value); }
+    bool Uint(unsigned value) { return number(value); }
+    bool Int64(int64_t value) { return number(value); }
+    bool Uint64(uint64_t value) { return number(static_cast<int64_t>(value)); }
+    bool Double(double value) { return number(static_cast<int64_t>(value)); }
+
+    bool StartArray()
+    {
+        if (skip_depth > 0 || open_nodes.empty() || is_in_children || key != "children")
+        {
+            ++skip_depth;
+            return true;
+        }
+        is_in_children = true;
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType)
+    {
+        if (skip_depth > 0)
+        {
+            --skip_depth;
+            return true;
+        }
+        is_in_children = false;
+        return true;
+    }
+
+    // rolls nodes up by source and writes the index
+    bool write(const std::string &file_name, std::string &error) const
+    {
+        std::vector<profile_index_function> functions;
+        std::vector<uint32_t> function_of_source(strings.size(), profile_index_no_id);
+        std::vector<uint32_t> node_functions(nodes.size(), profile_index_no_id);
+        for (size_t id = 0; id < nodes.size(); ++id)
+        {
+            auto &node = nodes[id];
+            if (node.source == 0)
+            {
+                continue;
+            }
+            auto &function_id = function_of_source[node.source];
+            if (function_id == profile_index_no_id)
+            {
+                function_id = static_cast<uint32_t>(functions.size());
+                profile_index_function function = {};
+                function.name = node.name;
+                function.source = node.source;
+                functions.push_back(function);
+            }
+            auto &function = functions[function_id];
+            if (function.name != node.name && strings[function.name].compare(0, 2, "?:") == 0)
+            {
+                function.name = node.name; // a better name, like the profiler's source map
+            }
+            ++function.node_count;
+            function.count += node.count;
+            add_times(function.times, node.times);
+            node_functions[id] = function_id;
+        }
+
+        // function nodes: counting sort by function, then by total time within each function
+        std::vector<uint32_t> function_nodes(nodes.size());
+        uint32_t offset = 0;
+        for (auto &&function : functions)
+        {
+            function.first_node = offset;
+            offset += function.node_count;
+        }
+        std::vector<uint32_t> fill(functions.size(), 0);
+        for (size_t id = 0; id < nodes.size(); ++id)
+        {
+            if (auto function_id = node_functions[id]; function_id != profile_index_no_id)
+            {
+                function_nodes[functions[function_id].first_node + fill[function_id]++] = static_cast<uint32_t>(id);
+            }
+        }
+        for (auto &&function : functions)
+        {
+            auto begin = function_nodes.begin() + function.first_node;
+            std::stable_sort(begin, begin + function.node_count, [&](uint32_t l, uint32_t r) {
+                return nodes[l].times.total_time > nodes[r].times.total_time;
+            });
+        }
+
+        auto sorted_functions = [&](auto key) {
+            std::vector<uint32_t> ids(functions.size());
+            for (size_t i = 0; i < ids.size(); ++i)
+            {
+                ids[i] = static_cast<uint32_t>(i);
+            }
+            std::stable_sort(ids.begin(), ids.end(), [&](uint32_t l, uint32_t r) { return key(functions[l]) > key(functions[r]); });
+            return ids;
+        };
+        auto by_total = sorted_functions([](const profile_index_function &f) { return f.times.total_time; });
+        auto by_self = sorted_functions([](const profile_index_function &f) { return f.times.self_time; });
+        auto by_count = sorted_functions([](const profile_index_function &f) { return f.count; });
+
+        std::string search_names;
+        for (auto &&id : by_total)
+        {
+            search_names += strings[functions[id].name];
+            search_names.push_back('\0');
+        }
+
+        std::vector<profile_index_string> string_table(strings.size());
+        uint64_t string_data_size = 0;
+        for (size_t i = 0; i < strings.size(); ++i)
+        {
+            string_table[i] = {string_data_size, strings[i].size()};
+            string_data_size += strings[i].size();
+        }
+
+        profile_index_header header = {};
+        header.magic = profile_index_magic;
+        header.version = profile_index_version;
+        header.flags = flags;
+        header.node_count = nodes.size();
+        header.function_count = functions.size();
+        header.string_count = strings.size();
+        header.nodes_offset = sizeof(header);
+        header.functions_offset = header.nodes_offset + nodes.size() * sizeof(profile_index_node);
+        header.function_nodes_offset = header.functions_offset + functions.size() * sizeof(profile_index_function);
+        header.by_total_offset = header.function_nodes_offset + function_nodes.size() * sizeof(uint32_t);
+        header.by_self_offset = header.by_total_offset + by_total.size() * sizeof(uint32_t);
+        header.by_count_offset = header.by_self_offset + by_self.size() * sizeof(uint32_t);
+        header.search_names_offset = header.by_count_offset + by_count.size() * sizeof(uint32_t);
+        header.search_names_size = search_names.size();
+        header.strings_offset = header.search_names_offset + search_names.size();
+        header.string_data_offset = header.strings_offset + string_table.size() * sizeof(profile_index_string);
+        header.string_data_size = string_data_size;
+
+        std::ofstream os(file_name, std::ios::binary);
+        if (!os)
+        {
+            error = fmt::format("can not write {}", file_name);
+            return false;
+        }
+        auto write_vector = [&](const auto &values) {
+            os.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(values[0]));
+        };
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write_vector(nodes);
+        write_vector(functions);
+        write_vector(function_nodes);
+        write_vector(by_total);
+        write_vector(by_self);
+        write_vector(by_count);
+        os.write(search_names.data(), search_names.size());
+        write_vector(string_table);
+        for (auto &&value : strings)
+        {
+            os.write(value.data(), value.size());
+        }
+        if (!os)
+        {
+            error = fmt::format("writing {} failed", file_name);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::vector<uint32_t> open_nodes;
+    std::string key;
+    bool is_in_children = false; // directly in the children array of open_nodes.back()
+    size_t skip_depth = 0;       // arrays and objects open in a skipped value
+    std::unordered_map<std::string, uint32_t> string_ids;
+
+    uint32_t intern(std::string_view value)
+    {
+        auto [itr, is_new] = string_ids.try_emplace(std::string(value), static_cast<uint32_t>(strings.size()));
+        if (is_new)
+        {
+            strings.emplace_back(value);
+        }
+        return itr->second;
+    }
+
+    bool number(int64_t value)
+    {
+        if (skip_depth > 0 || is_in_children)
+        {
+            return true;
+        }
+        if (open_nodes.empty())
+        {
+            return false;
+        }
+        auto &node = nodes[open_nodes.back()];
+        auto &times = node.times;
+        if (key == "count")
+        {
+            node.count = static_cast<uint64_t>(value);
+        }
+        else if (key == "total_time")
+        {
+            times.total_time = value;
+        }
+        else if (key == "self_time")
+        {
+            times.self_time = value;
+        }
+        else if (key == "children_time")
+        {
+            times.children_time = value;
+        }
+        else if (key.compare(0, 4, "cpu_") == 0)
+        {
+            flags |= profile_index_cpu_time;
+            if (key == "cpu_total_time")
+            {
+                times.cpu_total_time = value;
+            }
+            else if (key == "cpu_self_time")
+            {
+                times.cpu_self_time = value;
+            }
+            else if (key == "cpu_children_time")
+            {
+                times.cpu_children_time = value;
+            }
+        }
+        else if (auto counter = counter_of_key(); counter.first < profile_index_counter_count)
+        {
+            flags |= profile_index_perf_counters;
+            (counter.second ? times.perf_self : times.perf_total)[counter.first] = value;
+        }
+        return true; // other columns are not indexed
+    }
+
+    // {counter index, is self} of a <counter>_total or <counter>_self key, counter index is
+    // profile_index_counter_count for other keys
+    std::pair<size_t, bool> counter_of_key() const
+    {
+        for (size_t i = 0; i < profile_index_counter_count; ++i)
+        {
+            std::string_view name = profile_index_counter_names[i];
+            if (key.size() > name.size() && key.compare(0, name.size(), name) == 0)
+            {
+                auto suffix = std::string_view(key).substr(name.size());
+                if (suffix == "_total" || suffix == "_self")
+                {
+                    return {i, suffix == "_self"};
+                }
+            }
+        }
+        return {profile_index_counter_count, false};
+    }
+
+    static void add_times(profile_index_times &to, const profile_index_times &from)
+    {
+        to.total_time += from.total_time;
+        to.self_time += from.self_time;
+        to.children_time += from.children_time;
+        to.cpu_total_time += from.cpu_total_time;
+        to.cpu_self_time += from.cpu_self_time;
+        to.cpu_children_time += from.cpu_children_time;
+        for (size_t i = 0; i < profile_index_counter_count; ++i)
+        {
+            to.perf_total[i] += from.perf_total[i];
+            to.perf_self[i] += from.perf_self[i];
+        }
+    }
+};
+
+inline bool build_profile_index(const std::string &dump_file_name, const std::string &index_file_name, std::string &error)
+{
+    FILE *fp = std::fopen(dump_file_name.c_str(), "rb");
+    if (fp == nullptr)
+    {
+        error = fmt::format("can not open {}", dump_file_name);
+        return false;
+    }
+    std::vector<char> buffer(1 << 16);
+    rapidjson::FileReadStream stream(fp, buffer.data(), buffer.size());
+    rapidjson::Reader reader;
+    profile_index_builder builder;
+    auto result = reader.Parse(stream, builder);
+    std::fclose(fp);
+    if (result.IsError())
+    {
+        error = fmt::format("{} at {}: {}", dump_file_name, result.Offset(), rapidjson::GetParseError_En(result.Code()));
+        return false;
+    }
+    if (builder.nodes.empty())
+    {
+        error = fmt::format("{} has no profile", dump_file_name);
+        return false;
+    }
+    return builder.write(index_file_name, error);
+}
+
+// reads records where they are, each query touches only what it prints
+class profile_index_reader
+{
+public:
+    profile_index_header header = {};
+
+    bool open(const std::string &file_name, std::string &error)
+    {
+        is.open(file_name, std::ios::binary);
+        if (!is || !read_at(0, &header, sizeof(header)))
+        {
+            error = fmt::format("can not read {}", file_name);
+            return false;
+        }
+        if (header.magic != profile_index_magic || header.version != profile_index_version)
+        {
+            error = fmt::format("{} is not a lua profile index of version {}", file_name, profile_index_version);
+            return false;
+        }
+        return true;
+    }
+
+    profile_index_node node(uint32_t id)
+    {
+        profile_index_node result = {};
+        read_at(header.nodes_offset + uint64_t(id) * sizeof(result), &result, sizeof(result));
+        return result;
+    }
+
+    profile_index_function function(uint32_t id)
+    {
+        profile_index_function result = {};
+        read_at(header.functions_offset + uint64_t(id) * sizeof(result), &result, sizeof(result));
+        return result;
+    }
+
+    std::vector<uint32_t> ids(uint64_t offset, size_t begin, size_t count)
+    {
+        std::vector<uint32_t> result(count);
+        read_at(offset + begin * sizeof(uint32_t), result.data(), count * sizeof(uint32_t));
+        return result;
+    }
+
+    std::string string(uint32_t id)
+    {
+        profile_index_string entry = {};
+        read_at(header.strings_offset + uint64_t(id) * sizeof(entry), &entry, sizeof(entry));
+        std::string result(entry.length, '\0');
+        read_at(header.string_data_offset + entry.offset, result.data(), result.size());
+        return result;
+    }
+
+    std::string search_names()
+    {
+        std::string result(header.search_names_size, '\0');
+        read_at(header.search_names_offset, result.data(), result.size());
+        return result;
+    }
+
+private:
+    std::ifstream is;
+
+    bool read_at(uint64_t offset, void *data, size_t size)
+    {
+        is.clear();
+        is.seekg(static_cast<std::streamoff>(offset));
+        is.read(static_cast<char *>(data), static_cast<std::streamsize>(size));
+        return static_cast<bool>(is);
+    }
+};
+
+using profile_index_writer = rapidjson::Writer<rapidjson::StringBuffer>;
+
+// the keys of the dump, so the viewer reads fragments like the dump
+inline void write_index_times(profile_index_writer &writer, const profile_index_times &times, uint32_t flags)
+{
+    writer.Key("total_time");
+    writer.Int64(times.total_time);
+    writer.Key("self_time");
+    writer.Int64(times.self_time);
+    writer.Key("children_time");
+    writer.Int64(times.children_time);
+    if (flags & profile_index_cpu_time)
+    {
+        writer.Key("cpu_total_time");
+        writer.Int64(times.cpu_total_time);
+        writer.Key("cpu_self_time");
+        writer.Int64(times.cpu_self_time);
+        writer.Key("cpu_children_time");
+        writer.Int64(times.cpu_children_time);
+    }
+    if (flags & profile_index_perf_counters)
+    {
+        for (size_t i = 0; i < profile_index_counter_count; ++i)
+        {
+            auto name = std::string(profile_index_counter_names[i]);
+            writer.Key((name + "_self").c_str());
+            writer.Int64(times.perf_self[i]);
+            writer.Key((name + "_total").c_str());
+            writer.Int64(times.perf_total[i]);
+        }
+    }
+}
+
+inline void write_index_string(profile_index_writer &writer, const char *key, const std::string &value)
+{
+    writer.Key(key);
+    writer.String(value.data(), static_cast<rapidjson::SizeType>(value.size()));
+}
+
+// {id, function_name, function_source, count, times, child_count, children = [...]}, children down to depth
+// levels, at most max_children (0 for all) of them per node, in the total time order of the dump
+inline void write_index_subtree(profile_index_writer &writer, profile_index_reader &reader, uint32_t id, size_t depth, size_t max_children)
+{
+    auto node = reader.node(id);
+    writer.StartObject();
+    writer.Key("id");
+    writer.Uint(id);
+    write_index_string(writer, "function_name", reader.string(node.name));
+    write_index_string(writer, "function_source", reader.string(node.source));
+    writer.Key("count");
+    writer.Uint64(node.count);
+    write_index_times(writer, node.times, reader.header.flags);
+    writer.Key("child_count");
+    writer.Uint(node.child_count);
+    if (depth > 0 && node.child_count > 0)
+    {
+        writer.Key("children");
+        writer.StartArray();
+        size_t child_count = 0;
+        for (uint32_t child = id + 1; child < node.subtree_end && (max_children == 0 || child_count < max_children); ++child_count)
+        {
+            write_index_subtree(writer, reader, child, depth - 1, max_children);
+            child = reader.node(child).subtree_end;
+        }
+        writer.EndArray();
+    }
+    writer.EndObject();
+}
+
+inline void write_index_function(profile_index_writer &writer, profile_index_reader &reader, uint32_t id, const profile_index_function &function)
+{
+    writer.Key("id");
+    writer.Uint(id);
+    write_index_string(writer, "function_name", reader.string(function.name));
+    write_index_string(writer, "function_source", reader.string(function.source));
+    writer.Key("count");
+    writer.Uint64(function.count);
+    write_index_times(writer, function.times, reader.header.flags);
+    writer.Key("node_count");
+    writer.Uint(function.node_count);
+}
+
+// {total = function count, functions = [...]} by "total", "self" or "count"
+inline bool write_index_top(profile_index_writer &writer, profile_index_reader &reader, const std::string &sort, size_t top, size_t offset)
+{
+    uint64_t order_offset = sort == "total" ? reader.header.by_total_offset
+                            : sort == "self" ? reader.header.by_self_offset
+                            : sort == "count" ? reader.header.by_count_offset
+                                              : 0;
+    if (order_offset == 0)
+    {
+        return false;
+    }
+    size_t function_count = reader.header.function_count;
+    size_t begin = std::min(offset, function_count);
+    size_t end = top == 0 ? function_count : std::min(function_count, begin + top);
+    writer.StartObject();
+    writer.Key("total");
+    writer.Uint64(function_count);
+    writer.Key("functions");
+    writer.StartArray();
+    for (auto &&id : reader.ids(order_offset, begin, end - begin))
+    {
+        writer.StartObject();
+        write_index_function(writer, reader, id, reader.function(id));
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return true;
+}
+
+// {total = matched function count, functions = [...]}, functions whose name contains text by total time,
+// each with its first nodes by total time and their path of node ids from root to expand in the viewer
+inline void write_index_search(profile_index_writer &writer, profile_index_reader &reader, const std::string &text, size_t top)
+{
+    auto names = reader.search_names();
+    std::vector<size_t> matched_ranks;
+    size_t matched_count = 0;
+    size_t rank = 0;
+    for (size_t begin = 0; begin < names.size(); ++rank)
+    {
+        std::string_view name(names.data() + begin);
+        if (name.find(text) != std::string_view::npos)
+        {
+            if (top == 0 || matched_ranks.size() < top)
+            {
+                matched_ranks.push_back(rank);
+            }
+            ++matched_count;
+        }
+        begin += name.size() + 1;
+    }
+
+    writer.StartObject();
+    writer.Key("total");
+    writer.Uint64(matched_count);
+    writer.Key("functions");
+    writer.StartArray();
+    for (auto &&matched_rank : matched_ranks)
+    {
+        auto id = reader.ids(reader.header.by_total_offset, matched_rank, 1)[0];
+        auto function = reader.function(id);
+        writer.StartObject();
+        write_index_function(writer, reader, id, function);
+        writer.Key("nodes");
+        writer.StartArray();
+        auto node_count = std::min<size_t>(function.node_count, profile_index_search_nodes);
+        for (auto &&node_id : reader.ids(reader.header.function_nodes_offset, function.first_node, node_count))
+        {
+            auto node = reader.node(node_id);
+            std::vector<uint32_t> path = {node_id};
+            for (auto parent = node.parent; parent != profile_index_no_id; parent = reader.node(parent).parent)
+            {
+                path.push_back(parent);
+            }
+            writer.StartObject();
+            writer.Key("id");
+            writer.Uint(node_id);
+            writer.Key("count");
+            writer.Uint64(node.count);
+            write_index_times(writer, node.times, reader.header.flags);
+            writer.Key("path");
+            writer.StartArray();
+            for (auto itr = path.rbegin(); itr != path.rend(); ++itr)
+            {
+                writer.Uint(*itr);
+            }
+            writer.EndArray();
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
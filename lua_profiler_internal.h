@@ -0,0 +1,20 @@
+#pragma once
+// entry points of lua_profiler.cpp for LuaProfilerBenchmark, not part of the lua module, the
+// benchmark links libLuaProfiler and only reaches the profile through them
+#include <cstddef>
+#include <memory>
+#include <ostream>
+
+struct profile_data;
+
+// random tree of up to node_count nodes calling function_count functions, 1 to max_children
+// children per node, with times rolled up like a recorded profile
+std::shared_ptr<profile_data> new_synthetic_profile(size_t node_count, size_t function_count, size_t max_children);
+size_t get_profile_node_count(const profile_data &pd);
+size_t get_profile_function_count(const profile_data &pd);
+
+// report_tree(), report_list() and report_to_file("json") without limits, tree and list on
+// thread_count threads, the list is sorted again on each call
+void print_profile_tree(std::ostream &os, profile_data &pd, size_t thread_count);
+void print_profile_list(std::ostream &os, profile_data &pd, size_t thread_count);
+void print_profile_json(std::ostream &os, profile_data &pd);
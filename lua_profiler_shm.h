@@ -0,0 +1,78 @@
+#pragma once
+// fixed layout of the shared memory segment published by profiler.live_export{...}
+// and read by lua_profiler_top, both sides must be built from the same version
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+static constexpr uint32_t shm_profile_magic = 0x4c50524f; // "LPRO"
+static constexpr uint32_t shm_profile_version = 2;
+static constexpr size_t shm_profile_max_functions = 1024;
+static constexpr size_t shm_profile_max_roots = 64;
+static constexpr size_t shm_profile_name_length = 128;
+static constexpr size_t shm_profile_counter_count = 4; // instructions, cycles, cache_misses, branch_misses
+
+// shm_profile_snapshot::columns, set when the profile records them
+static constexpr uint32_t shm_profile_cpu_time = 1 << 0;
+static constexpr uint32_t shm_profile_perf_counters = 1 << 1;
+
+// times in nanoseconds
+struct shm_profile_entry
+{
+    char function_name[shm_profile_name_length];
+    uint64_t count;
+    int64_t total_time;
+    int64_t self_time;
+    int64_t children_time;
+    int64_t cpu_total_time;
+    int64_t cpu_self_time;
+    int64_t perf_total[shm_profile_counter_count];
+    int64_t perf_self[shm_profile_counter_count];
+};
+
+// everything after sequence is a snapshot, consistent when sequence is even and unchanged around the copy
+struct shm_profile_snapshot
+{
+    uint64_t publish_count;
+    int64_t publish_time; // system clock, nanoseconds since epoch
+    int64_t root_total_time;
+    uint32_t function_count;
+    uint32_t root_count;
+    uint32_t columns;
+    shm_profile_entry functions[shm_profile_max_functions]; // print_list order, by total time
+    shm_profile_entry roots[shm_profile_max_roots];         // top level of the tree, by total time
+};
+
+struct shm_profile_layout
+{
+    uint32_t magic;
+    uint32_t version;
+    int64_t pid;
+    std::atomic<uint64_t> sequence;
+    shm_profile_snapshot snapshot;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory sequence must be lock free");
+
+// single writer, odd sequence while writing
+inline void shm_profile_write(shm_profile_layout &layout, const shm_profile_snapshot &snapshot)
+{
+    auto sequence = layout.sequence.load(std::memory_order_relaxed);
+    layout.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&layout.snapshot, &snapshot, sizeof(snapshot));
+    layout.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// returns false if the writer was busy, retry later
+inline bool shm_profile_read(const shm_profile_layout &layout, shm_profile_snapshot &snapshot)
+{
+    auto begin_sequence = layout.sequence.load(std::memory_order_acquire);
+    if (begin_sequence & 1)
+    {
+        return false;
+    }
+    std::memcpy(&snapshot, &layout.snapshot, sizeof(snapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return layout.sequence.load(std::memory_order_relaxed) == begin_sequence;
+}
@@ -0,0 +1,146 @@
+// lua_profiler_top <shm name> [top] [refresh ms] [sort]
+//   live top-N of a process exporting with profiler.live_export{...}
+//   sort is total (default), self, count or cpu
+#include <fmt/format.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lua_profiler_shm.h"
+
+using namespace std::chrono;
+
+static const char *counter_names[shm_profile_counter_count] = {"instructions", "cycles", "cache misses", "branch misses"};
+
+static void print_entries(const shm_profile_entry *entries, size_t count, size_t top, const std::string &sort, int64_t root_total_time, uint32_t columns)
+{
+    std::vector<const shm_profile_entry *> sorted_entries;
+    for (size_t i = 0; i < count; ++i)
+    {
+        sorted_entries.push_back(&entries[i]);
+    }
+    auto key = [&](const shm_profile_entry *entry) -> int64_t {
+        if (sort == "self")
+        {
+            return entry->self_time;
+        }
+        if (sort == "count")
+        {
+            return static_cast<int64_t>(entry->count);
+        }
+        if (sort == "cpu")
+        {
+            return entry->cpu_total_time;
+        }
+        return entry->total_time;
+    };
+    std::stable_sort(sorted_entries.begin(), sorted_entries.end(), [&](auto l, auto r) { return key(l) > key(r); });
+    sorted_entries.resize(std::min(sorted_entries.size(), top));
+
+    size_t max_name_length = 8;
+    for (auto &&entry : sorted_entries)
+    {
+        max_name_length = std::max(max_name_length, std::strlen(entry->function_name));
+    }
+    std::string line = fmt::format("{:{}} {:>12} {:>14} {:>14} {:>7}", "function", max_name_length, "count", "total ms", "self ms", "total%");
+    if (columns & shm_profile_cpu_time)
+    {
+        fmt::format_to(std::back_inserter(line), " {:>14} {:>14}", "cpu ms", "cpu self ms");
+    }
+    if (columns & shm_profile_perf_counters)
+    {
+        for (auto &&counter_name : counter_names)
+        {
+            fmt::format_to(std::back_inserter(line), " {:>14}", counter_name);
+        }
+    }
+    std::cout << line << "\n";
+    for (auto &&entry : sorted_entries)
+    {
+        double percent = root_total_time > 0 ? 100.0 * entry->total_time / root_total_time : 0.0;
+        line = fmt::format("{:{}} {:>12} {:>14.3f} {:>14.3f} {:>6.1f}%",
+                           entry->function_name, max_name_length,
+                           entry->count,
+                           entry->total_time / 1e6,
+                           entry->self_time / 1e6,
+                           percent);
+        if (columns & shm_profile_cpu_time)
+        {
+            fmt::format_to(std::back_inserter(line), " {:>14.3f} {:>14.3f}", entry->cpu_total_time / 1e6, entry->cpu_self_time / 1e6);
+        }
+        if (columns & shm_profile_perf_counters)
+        {
+            for (auto &&counter : entry->perf_total)
+            {
+                fmt::format_to(std::back_inserter(line), " {:>14}", counter);
+            }
+        }
+        std::cout << line << "\n";
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "usage: lua_profiler_top <shm name> [top] [refresh ms] [total|self|count|cpu]" << std::endl;
+        return 1;
+    }
+    std::string name = argv[1];
+    size_t top = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 20;
+    auto refresh = milliseconds(argc > 3 ? std::strtoll(argv[3], nullptr, 10) : 1000);
+    std::string sort = argc > 4 ? argv[4] : "total";
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+        std::cout << fmt::format("can not open {}: {}", name, std::strerror(errno)) << std::endl;
+        return 1;
+    }
+    void *address = mmap(nullptr, sizeof(shm_profile_layout), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        std::cout << fmt::format("can not map {}: {}", name, std::strerror(errno)) << std::endl;
+        return 1;
+    }
+    auto &layout = *static_cast<const shm_profile_layout *>(address);
+    if (layout.magic != shm_profile_magic || layout.version != shm_profile_version)
+    {
+        std::cout << fmt::format("{} is not a lua profiler export of version {}", name, shm_profile_version) << std::endl;
+        return 1;
+    }
+
+    auto snapshot = std::make_unique<shm_profile_snapshot>();
+    while (true)
+    {
+        while (!shm_profile_read(layout, *snapshot))
+        {
+            std::this_thread::yield();
+        }
+        auto now = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+        std::cout << "\x1b[2J\x1b[H";
+        std::cout << fmt::format("pid:{} publishes:{} age:{:.1f} ms functions:{} total:{:.3f} ms",
+                                 layout.pid,
+                                 snapshot->publish_count,
+                                 (now - snapshot->publish_time) / 1e6,
+                                 snapshot->function_count,
+                                 snapshot->root_total_time / 1e6)
+                  << "\n\n";
+        print_entries(snapshot->roots, snapshot->root_count, top, sort, snapshot->root_total_time, snapshot->columns);
+        std::cout << "\n";
+        print_entries(snapshot->functions, snapshot->function_count, top, sort, snapshot->root_total_time, snapshot->columns);
+        std::cout << std::flush;
+        std::this_thread::sleep_for(refresh);
+    }
+    return 0;
+}
@@ -178,3 +178,407 @@ for i = 1,100,1 do
     end
 end
 
+
+----- profiler features, each on a profile of its own, skipped when this script is the profiled one
+local profiler = require("profiler")
+local is_profiled = debug.gethook() ~= nil
+
+local profile = function(options, f)
+    profiler.clear()
+    profiler.start(options)
+    f()
+    profiler.stop()
+end
+
+local busy = function(n)
+    local s = 0
+    for i = 1, n do
+        s = s + i
+    end
+    return s
+end
+
+---- report totals, up to date while running
+if not is_profiled then
+    profile(nil, function()
+        for i = 1, 10 do
+            busy(1000)
+        end
+        local list = profiler.report_list()
+        assert(list:find("busy:test.lua:%d+%s+count:10%s"), list)
+    end)
+    local tree = profiler.report_tree()
+    local root_total = tonumber(tree:match("^root%s+count:%d+%s+total:(%d+)"))
+    local busy_total = tonumber(tree:match("busy:[^\n]-total:(%d+)"))
+    assert(root_total >= busy_total, tree)
+    print(tree)
+    profiler.clear()
+end
+
+---- parallel reports, a tree big enough to be split over threads prints the same as on one thread
+if not is_profiled then
+    local fs = {}
+    for i = 1, 260 do
+        fs[i] = load("local fs = ... return function(depth) if depth > 0 then for i = 1, #fs do fs[i](depth - 1) end end end", "=f" .. i)(fs)
+    end
+    profile(nil, function()
+        for i = 1, #fs do
+            fs[i](1)
+        end
+    end)
+    local thread_count = profiler.report_threads()
+    profiler.report_threads(1)
+    local tree, list = profiler.report_tree(), profiler.report_list()
+    profiler.report_threads(4)
+    assert(tree == profiler.report_tree())
+    assert(list == profiler.report_list())
+    profiler.report_threads(thread_count)
+    print(profiler.report_list(3))
+    profiler.clear()
+end
+
+---- hook features, without coroutines, tail calls and names
+if not is_profiled then
+    local in_coroutine = function()
+        return busy(10) + 1
+    end
+    local tail = function(n)
+        return busy(n)
+    end
+    local source_of = function(f)
+        return "test.lua:" .. debug.getinfo(f, "S").linedefined .. " "
+    end
+    profile({coroutine = false, tail_call = false, compensation = false, name = false, clock = "coarse"}, function()
+        coroutine.wrap(in_coroutine)()
+        tail(10)
+    end)
+    local list = profiler.report_list()
+    assert(not list:find(source_of(in_coroutine), 1, true), list)
+    assert(not list:find(source_of(busy), 1, true), list)
+    assert(list:find("?:" .. source_of(tail), 1, true), list)
+    print(list)
+    profiler.clear()
+end
+
+---- coroutine switches, a wrapped coroutine resumed from another one and a resume kept over clear()
+if not is_profiled then
+    local resume
+    profile(nil, function()
+        local inner = coroutine.wrap(function()
+            for i = 1, 3 do
+                busy(10)
+                coroutine.yield()
+            end
+        end)
+        local outer = coroutine.create(function()
+            for i = 1, 3 do
+                inner()
+                coroutine.yield()
+            end
+        end)
+        resume = coroutine.resume
+        for i = 1, 3 do
+            resume(outer)
+        end
+    end)
+    local tree = profiler.report_tree()
+    assert(select(2, tree:gsub("\n%s+coroutine:[^\n]-count:3%s", "")) == 2, tree)
+    assert(profiler.report_list():find("busy:[^\n]-count:3%s"), tree)
+    print(tree)
+    profiler.clear()
+    assert(resume(coroutine.create(busy), 10))
+end
+
+---- thread cpu time, kept beside the wall clock times for calls in and out of coroutines
+if not is_profiled then
+    profile({cpu_time = true}, function()
+        local co = coroutine.wrap(function()
+            busy(1000)
+            coroutine.yield()
+            busy(1000)
+        end)
+        co()
+        busy(1000)
+        co()
+    end)
+    local list = profiler.report_list()
+    local cpu_self = ("\n" .. list):match("\nbusy:[^\n]-count:3%s[^\n]-cpu_self:(%d+)")
+    assert(cpu_self and tonumber(cpu_self) > 0, list)
+    print(list)
+    profiler.clear()
+end
+
+---- frames, a mark per tick closes the frame the calls since the last mark ran in
+if not is_profiled then
+    profile(nil, function()
+        profiler.frame_config{budget = 0.001, history = 4, spikes = 2, dump = false}
+        assert(profiler.frame_mark() == nil)
+        for i = 1, 6 do
+            busy(1000)
+            assert(profiler.frame_mark() > 0)
+        end
+    end)
+    local frames = profiler.report_frames()
+    assert(frames:find("^frames:6 "), frames)
+    assert(frames:find("spikes:6"), frames)
+    assert(select(2, frames:match("\nrecent:([^\n]*)"):gsub("%d+", "")) == 4, frames)
+    assert(frames:find("\nbusy:[^\n]-count:1%.00%s"), frames)
+    print(frames)
+    profiler.clear()
+end
+
+---- flight recorder, a call over its threshold keeps the events around it, enabled = false stops it
+if not is_profiled then
+    local slow = function()
+        busy(10000)
+    end
+    profile(nil, function()
+        profiler.flight_config{threshold = 1000, thresholds = {["test.lua:" .. debug.getinfo(slow, "S").linedefined] = 0.001}, window = 16, after = 2, traces = 2, dump = false}
+        for i = 1, 3 do
+            slow()
+            busy(10)
+        end
+        profiler.flight_config{enabled = false}
+        slow()
+    end)
+    local calls = profiler.slow_calls()
+    assert(#calls == 2, #calls)
+    for _, call in ipairs(calls) do
+        assert(call.name:find("^slow:"), call.name)
+        assert(call.duration > call.threshold, call.trace)
+        assert(call.trace:find("return%s+slow:[^\n]-<%-%- slow\n"), call.trace)
+        assert(call.trace:find("call%s+busy:"), call.trace)
+    end
+    assert(calls[2].trace:find("(trace 3)", 1, true), calls[2].trace)
+    print(calls[2].trace)
+    profiler.clear()
+end
+
+---- live export, the list is published to shared memory until the export is removed
+if not is_profiled and package.config:sub(1, 1) == "/" then
+    local name
+    profile(nil, function()
+        name = profiler.live_export{name = "/lua_profiler_test." .. tostring(os.time()), interval = 0}
+        busy(100)
+        busy(100)
+    end)
+    local segment = io.open("/dev/shm" .. name, "rb") -- linux keeps posix shared memory there
+    if segment then
+        local content = segment:read("a")
+        segment:close()
+        assert(content:find("busy:test.lua:", 1, true))
+    end
+    profiler.live_export(false)
+    assert(io.open("/dev/shm" .. name, "rb") == nil, name)
+    profiler.clear()
+end
+
+---- coroutine targets, attach and detach
+if not is_profiled then
+    local step = function()
+        return busy(10)
+    end
+    local other_step = function()
+        return busy(10)
+    end
+    local body = function()
+        while true do
+            step()
+            coroutine.yield()
+        end
+    end
+    local other_body = function()
+        while true do
+            other_step()
+            coroutine.yield()
+        end
+    end
+    local has_call = function(list, f)
+        return list:find("\n" .. "[^\n:]*:test.lua:" .. debug.getinfo(f, "S").linedefined .. "%s") ~= nil
+    end
+
+    -- no hook for new coroutines, only the attached one is recorded until it is detached
+    local attached = coroutine.create(body)
+    profiler.clear()
+    assert(profiler.attach(attached) == false)
+    profile({coroutines = "none"}, function()
+        coroutine.wrap(other_body)()
+        assert(profiler.attach(attached))
+        coroutine.resume(attached)
+        coroutine.resume(attached)
+        profiler.detach(attached)
+        coroutine.resume(attached)
+    end)
+    local list = "\n" .. profiler.report_list()
+    assert(not has_call(list, other_step), list)
+    assert(list:find("\nstep:[^\n]-count:2%s"), list)
+    print(list)
+
+    -- only coroutines with a listed body
+    profile({coroutines = {body}}, function()
+        coroutine.wrap(body)()
+        coroutine.wrap(other_body)()
+    end)
+    list = "\n" .. profiler.report_list()
+    assert(has_call(list, step), list)
+    assert(not has_call(list, other_step), list)
+    print(list)
+    profiler.clear()
+end
+
+---- query, pages of a snapshot taken by the first query and renewed by refresh
+if not is_profiled then
+    local leaf = function()
+        local s = busy(10)
+        return s
+    end
+    local branch = function()
+        leaf()
+        leaf()
+    end
+    profile({cpu_time = true}, function()
+        for i = 1, 3 do
+            branch()
+        end
+        local page, total = profiler.query{by = "source", sort = "count", top = 2}
+        assert(#page == 2 and total >= 4, total)
+        assert(page[1].name:find("^busy:") and page[1].count == 6, page[1].name)
+        assert(page[2].name:find("^leaf:") and page[2].count == 6, page[2].name)
+        assert(page[1].cpu_total and page[1].cpu_self, page[1].name)
+        local next_page = profiler.query{by = "source", sort = "count", top = 2, offset = 1}
+        assert(next_page[1].name == page[2].name)
+        branch()
+        assert(profiler.query{by = "source", sort = "count", top = 1}[1].count == 6)
+        assert(profiler.query{by = "source", sort = "count", top = 1, refresh = true}[1].count == 8)
+    end)
+    local path = {}
+    for _, entry in ipairs(profiler.query{by = "path", depth = 0}) do
+        if entry.depth == 1 and entry.name:find("^f:") or entry.depth == 2 and entry.name:find("^branch:") then
+            path[entry.depth] = entry.name
+        end
+    end
+    local page, total = profiler.query{by = "path", root = path, depth = 1}
+    assert(total == 1 and page[1].name:find("^leaf:") and page[1].count == 8, total)
+    assert(page[1].depth == 1 and page[1].child_count == 1, page[1].depth)
+    profiler.clear()
+end
+
+---- pprof, self only sample types, readable without zlib
+if not is_profiled then
+    profile({cpu_time = true}, function()
+        busy(100)
+    end)
+    local file_name = profiler.report_to_file("pprof")
+    assert(file_name:find("%.lua_profile%.pb"), file_name)
+    if file_name:find("%.pb$") then
+        local file = assert(io.open(file_name, "rb"))
+        local content = file:read("a")
+        file:close()
+        for _, sample_type in ipairs({"calls", "self_time", "cpu_self_time", "nanoseconds", "busy:test.lua:"}) do
+            assert(content:find(sample_type, 1, true), sample_type)
+        end
+        assert(not content:find("total_time", 1, true))
+    end
+    os.remove(file_name)
+    profiler.clear()
+end
+
+---- adaptive, after sampling only the hot function and its callers are recorded
+if not is_profiled then
+    local hot = function(n)
+        local s = busy(n)
+        return s
+    end
+    local cold = {}
+    for i = 1, 20 do
+        cold[i] = function(x)
+            return x + i
+        end
+    end
+    local cold_line = debug.getinfo(cold[1], "S").linedefined
+    profile({adaptive = true, hot = 2, sample_interval = 100, sample_time = 5, rerank = 1000}, function()
+        local begin_time = os.clock()
+        while os.clock() - begin_time < 0.05 do
+            for i = 1, 20 do
+                cold[i](i)
+            end
+            hot(2000)
+        end
+    end)
+    local info = profiler.report_info()
+    local rejected = tonumber(info:match("rejected_events:(%d+)"))
+    assert(rejected and rejected > 0, info)
+    local list = "\n" .. profiler.report_list()
+    assert(list:find("\nbusy:"), list)
+    assert(not list:find(":test.lua:" .. cold_line .. "%s"), list)
+    print(info)
+    profiler.clear()
+end
+
+---- hardware counters, columns only where the machine lets the profile read them
+if not is_profiled then
+    profile({perf_counters = true}, function()
+        busy(1000)
+    end)
+    local info = profiler.report_info()
+    assert(info:find(" perf_counters: instructions:%a+ cycles:%a+ cache_misses:%a+ branch_misses:%a+ by:%a+"), info)
+    if info:find("instructions:on", 1, true) then
+        local list = "\n" .. profiler.report_list()
+        local instructions = list:match("\nbusy:[^\n]- instructions:(%d+)")
+        assert(instructions and tonumber(instructions) > 1000, list)
+    end
+    print(info)
+    profiler.clear()
+end
+
+---- call graph, recursion counted once in the totals of the graph and of the reports
+if not is_profiled then
+    local rec
+    rec = function(n)
+        busy(10)
+        if n > 0 then
+            rec(n - 1)
+        end
+    end
+    profile({graph = true}, function()
+        rec(50)
+        rec(50)
+    end)
+    local tree = profiler.report_tree()
+    local root_total = tonumber(tree:match("^root%s+count:%d+%s+total:(%d+)"))
+    local rec_count, rec_total = tree:match("\n%s+rec:[^\n]-count:(%d+)%s+total:(%d+)")
+    assert(tonumber(rec_count) == 102 and root_total >= tonumber(rec_total), tree)
+    local list_total = tonumber(("\n" .. profiler.report_list()):match("\nrec:[^\n]-total:(%d+)"))
+    assert(root_total >= list_total, list_total)
+
+    local callers, function_entry = profiler.callers(rec)
+    assert(function_entry.count == 102 and root_total >= function_entry.total, function_entry.total)
+    assert(#callers == 2, #callers)
+    for _, caller in ipairs(callers) do
+        assert(caller.total <= function_entry.total, caller.name)
+        assert(caller.count == (caller.name:find("^rec:") and 100 or 2), caller.name)
+    end
+    local callees = profiler.callees(rec)
+    assert(#callees == 2 and callees[1].name:find("^rec:") and callees[2].name:find("^busy:"), #callees)
+    assert(callees[2].count == 102)
+    profiler.clear()
+end
+
+---- json dump, the keys lua_profiler_index and the viewer read
+if not is_profiled then
+    profile({cpu_time = true}, function()
+        busy(100)
+    end)
+    local file_name = profiler.report_to_file("json")
+    assert(file_name:find("%.lua_profile_json%.txt$"), file_name)
+    local file = assert(io.open(file_name, "r"))
+    local content = file:read("a")
+    file:close()
+    os.remove(file_name)
+    assert(content:find('^{"function_name":"root"'), content)
+    assert(content:find('"function_name":"busy:test.lua:%d+","function_source":"lua:test.lua:%d+"'), content)
+    for _, key in ipairs({"count", "self_time", "children_time", "total_time", "cpu_self_time", "cpu_total_time", "children"}) do
+        assert(content:find('"' .. key .. '":'), key)
+    end
+    profiler.clear()
+end